@@ -1,18 +1,67 @@
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <cerrno>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+#include <cstdio>
 #include "BasicExcel.hpp"
 
+// Character conversions use SSE2, which every x86-64 host has, and AVX2 when the compiler targets it.
+#if defined(__AVX2__)
+	#define SIMD_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define SIMD_SSE2
+#endif
+#if defined(SIMD_AVX2)
+	#include <immintrin.h>
+#elif defined(SIMD_SSE2)
+	#include <emmintrin.h>
+#endif
+
 namespace YCompoundFiles
 {
 /********************************** Start of Class Block *************************************/
 // PURPOSE: Manage a file by treating it as blocks of data of a certain size.
+// EXPLAIN: A file opened for writing is held in memory as an image of all its blocks. 
+// EXPLAIN: Blocks are read, written, moved, inserted and erased in the image, 
+// EXPLAIN: and the changed blocks are written to the file by Flush() or Close().
+// EXPLAIN: With atomic saving, no handle to the file is kept. Flush() writes the image to a 
+// EXPLAIN: temporary file in the same directory and renames it over the file.
 Block::Block() : 
 	blockSize_(512), fileSize_(0), indexEnd_(0),
-	filename_(0) {}
+	filename_(0), mode_(ios_base::in | ios_base::out), mapping_(0), rewrite_(false),
+	memory_(false), atomic_(false), syncPolicy_(SYNC_NONE) {}
+
+Block::~Block() {this->Close();}
 
 bool Block::Create(const wchar_t* filename)
 // PURPOSE: Create a new block file and open it.
 // PURPOSE: If file is present, truncate it and then open it.
+// EXPLAIN: With atomic saving, the file is only created or truncated by Flush().
 // PROMISE: Return true if file is successfully created and opened, false if otherwise.
 {
+	if (atomic_)
+	{
+		size_t filenameLength = wcslen(filename);
+		filename_.assign(filenameLength+1, 0);
+		wcstombs(&*(filename_.begin()), filename, filenameLength);
+		mode_ = ios_base::in | ios_base::out;
+		fileSize_ = 0;
+		indexEnd_ = 0;
+		image_.clear();
+		dirty_.clear();
+		rewrite_ = true;
+		memory_ = true;
+		return true;
+	}
+
 	// Create new file
 	size_t filenameLength = wcslen(filename);
 	char* name = new char[filenameLength+1];
@@ -29,6 +78,32 @@ bool Block::Create(const wchar_t* filename)
 	return ret;
 }
 
+bool Block::Create()
+// PURPOSE: Create a new block file which is held only in memory.
+// EXPLAIN: The contents can be copied out with CopyTo().
+// PROMISE: Return true if the block file is successfully created, false if otherwise.
+{
+	this->Close();
+	mode_ = ios_base::in | ios_base::out;
+	memory_ = true;
+	return true;
+}
+
+bool Block::Open(const char* data, size_t size)
+// PURPOSE: Open a block file held in a memory buffer for reading.
+// EXPLAIN: The buffer is used in place without copying. It is not owned by the block file 
+// EXPLAIN: and must stay valid until the block file is closed.
+// PROMISE: Return true if the block file is successfully opened, false if otherwise.
+{
+	this->Close();
+	if (data == 0 || size == 0) return false;
+	mapping_ = data;
+	fileSize_ = size;
+	mode_ = ios_base::in;
+	indexEnd_ = fileSize_/blockSize_ + (fileSize_ % blockSize_ ? 1 : 0);
+	return true;
+}
+
 bool Block::Open(const wchar_t* filename, ios_base::openmode mode)
 // PURPOSE: Open an existing block file.
 // PROMISE: Return true if file is successfully opened, false if otherwise.
@@ -38,6 +113,14 @@ bool Block::Open(const wchar_t* filename, ios_base::openmode mode)
 	filename_.resize(filenameLength+1, 0);
 	wcstombs(&*(filename_.begin()), filename, filenameLength);
 
+	// Files opened only for reading are memory mapped if possible.
+	if ((mode & ios_base::in) && !(mode & ios_base::out) && this->Map())
+	{
+		mode_ = mode;
+		indexEnd_ = fileSize_/blockSize_ + (fileSize_ % blockSize_ ? 1 : 0);
+		return true;
+	}
+
 	file_.open(&*(filename_.begin()), mode | ios_base::binary);
 	if (!file_.is_open()) return false;
 
@@ -62,6 +145,32 @@ bool Block::Open(const wchar_t* filename, ios_base::openmode mode)
 	
 	// Calculate last index + 1
 	indexEnd_ = fileSize_/blockSize_ + (fileSize_ % blockSize_ ? 1 : 0);
+
+	// Load a writable file into the block image in one read.
+	if (mode & ios_base::out)
+	{
+		image_.assign(indexEnd_*blockSize_, 0);
+		dirty_.assign(indexEnd_, false);
+		rewrite_ = false;
+		if (fileSize_ && (mode & ios_base::in))
+		{
+			file_.seekg(0);
+			file_.read(&*(image_.begin()), fileSize_);
+			if (file_.fail())
+			{
+				this->Close();
+				return false;
+			}
+		}
+
+		// An atomically saved file is replaced as a whole, so the handle is not needed.
+		if (atomic_)
+		{
+			file_.close();
+			file_.clear();
+			memory_ = true;
+		}
+	}
 	return true;
 }
 
@@ -69,6 +178,12 @@ bool Block::Close()
 // PURPOSE: Close the opened block file.
 // PROMISE: Return true if file is successfully closed, false if otherwise.
 {
+	if (file_.is_open() || memory_) this->Flush();
+	image_.clear();
+	dirty_.clear();
+	rewrite_ = false;
+	memory_ = false;
+	this->Unmap();
 	file_.close();
 	file_.clear();
 	filename_.clear(); 
@@ -82,41 +197,107 @@ bool Block::IsOpen()
 // PURPOSE: Check if the block file is still opened.
 // PROMISE: Return true if file is still opened, false if otherwise.
 {
-	return file_.is_open();
+	return mapping_ != 0 || memory_ || file_.is_open();
 }
 
-bool Block::Read(size_t index, char* block)
-// PURPOSE: Read a block of data from the opened file at the index position.
+bool Block::Flush()
+// PURPOSE: Write all changed blocks in the block image to the opened file.
+// EXPLAIN: Each run of consecutive changed blocks is written with a single write and 
+// EXPLAIN: the file is truncated if blocks were erased.
+// EXPLAIN: With atomic saving, the whole file is replaced if any block has changed.
+// PROMISE: Return true if data are successfully written, false if otherwise.
+{
+	if (!(mode_ & ios_base::out)) return true;
+	if (memory_)
+	{
+		// Block files created by Create() are held only in memory and have nothing to write.
+		bool changed = rewrite_ || find(dirty_.begin(), dirty_.end(), true) != dirty_.end();
+		if (!filename_.empty() && changed && !this->Replace()) return false;
+	}
+	else if (!file_.is_open()) return false;
+	else
+	{
+		file_.clear();
+		for (size_t i=0; i<indexEnd_; )
+		{
+			if (!dirty_[i]) 
+			{
+				++i;
+				continue;
+			}
+			size_t end = i+1;
+			while (end < indexEnd_ && dirty_[end]) ++end;
+			file_.seekp(i * blockSize_);
+			file_.write(&*(image_.begin()) + i*blockSize_, (end-i)*blockSize_);
+			i = end;
+		}
+		file_.flush();
+		if (file_.fail()) return false;
+		if (rewrite_ && !this->Truncate()) return false;
+	}
+	dirty_.assign(indexEnd_, false);
+	rewrite_ = false;
+	return true;
+}
+
+bool Block::Read(size_t index, char* block, size_t count)
+// PURPOSE: Read count consecutive blocks of data from the opened file starting at the index position.
 // EXPLAIN: index is from [0..].
+// EXPLAIN: The blocks are read with a single copy or a single stream read.
 // PROMISE: Return true if data are successfully read, false if otherwise.
 {
 	if (!(mode_ & ios_base::in)) return false;
-	if (index < indexEnd_)
+	if (index + count <= indexEnd_)
 	{
+		if (mapping_ || (mode_ & ios_base::out))
+		{
+			const char* data = this->Data(index+count-1);
+			if (data == 0) return false;
+			data = this->Data(index);
+			copy(data, data+count*blockSize_, block);
+			return true;
+		}
+
+		file_.clear();
 		file_.seekg(index * blockSize_);
-		file_.read(block, blockSize_);
+		file_.read(block, count * blockSize_);
 		return !file_.fail();
 	}
 	else return false;
 }
 
+const char* Block::Data(size_t index) const
+// PURPOSE: Get a pointer to a block of data in the block image or memory mapped file at the index position.
+// EXPLAIN: index is from [0..].
+// PROMISE: Return a pointer which stays valid until the file is changed or closed, 
+// PROMISE: or 0 if the file is read through a stream or the block is incomplete.
+{
+	if (mode_ & ios_base::out)
+	{
+		if (index >= indexEnd_) return 0;
+		return &*(image_.begin()) + index*blockSize_;
+	}
+	if (mapping_ == 0 || (index+1)*blockSize_ > fileSize_) return 0;
+	return mapping_ + index*blockSize_;
+}
+
 bool Block::Write(size_t index, const char* block)
 // PURPOSE: Write a block of data to the opened file at the index position.
 // EXPLAIN: index is from [0..].
+// EXPLAIN: The block is written to the block image and only written to the file by Flush() or Close().
 // PROMISE: Return true if data are successfully written, false if otherwise.
 {
 	if (!(mode_ & ios_base::out)) return false;
-	file_.seekp(index * blockSize_);
-	file_.write(block, blockSize_);
 	if (indexEnd_ <= index) 
 	{
 		indexEnd_ = index + 1;
-		fileSize_ += blockSize_;
+		fileSize_ = indexEnd_ * blockSize_;
+		image_.resize(fileSize_, 0);
+		dirty_.resize(indexEnd_, true);
 	}
-	file_.close();
-	file_.clear();
-	file_.open(&*(filename_.begin()), mode_ | ios_base::binary);
-	return file_.is_open();		
+	copy(block, block+blockSize_, image_.begin()+index*blockSize_);
+	dirty_[index] = true;
+	return true;
 }
 
 bool Block::Swap(size_t index1, size_t index2)
@@ -129,17 +310,11 @@ bool Block::Swap(size_t index1, size_t index2)
 	{
 		if (index1 == index2) return true;
 		
-		char* block1 = new char[blockSize_];
-		if (!this->Read(index1, block1)) return false;
-		
-		char* block2 = new char[blockSize_];
-		if (!this->Read(index2, block2)) return false;
-		
-		if (!this->Write(index1, block2)) return false;
-		if (!this->Write(index2, block1)) return false;
-		
-		delete[] block1;
-		delete[] block2;
+		swap_ranges(image_.begin()+index1*blockSize_, 
+					image_.begin()+(index1+1)*blockSize_, 
+					image_.begin()+index2*blockSize_);
+		dirty_[index1] = true;
+		dirty_[index2] = true;
 		return true;
 	}
 	else return false;
@@ -148,25 +323,16 @@ bool Block::Swap(size_t index1, size_t index2)
 bool Block::Move(size_t from, size_t to)
 // PURPOSE: Move a block of data in the opened file from an index position to another index position.
 // EXPLAIN: from and to are from [0..].
+// EXPLAIN: Blocks in between are shifted by one position towards from.
 // PROMISE: Return true if data are successfully moved, false if otherwise.
 {
 	if (!(mode_ & ios_base::out)) return false;
 	if (from < indexEnd_ && to < indexEnd_)
 	{
-		if (to > from)
-		{
-			for (size_t i=from; i!=to; ++i)
-			{
-				if (!this->Swap(i, i+1)) return false;	
-			}
-		}
-		else
-		{
-			for (size_t i=from; i!=to; --i)
-			{
-				if (!this->Swap(i, i-1)) return false;	
-			}
-		}
+		vector<char>::iterator image = image_.begin();
+		if (to > from) rotate(image+from*blockSize_, image+(from+1)*blockSize_, image+(to+1)*blockSize_);
+		else if (to < from) rotate(image+to*blockSize_, image+from*blockSize_, image+(from+1)*blockSize_);
+		fill(dirty_.begin()+min(from, to), dirty_.begin()+max(from, to)+1, true);
 		return true;	
 	}
 	else return false;
@@ -180,12 +346,14 @@ bool Block::Insert(size_t index, const char* block)
 	if (!(mode_ & ios_base::out)) return false;
 	if (index <= indexEnd_)
 	{
-		// Write block to end of file
-		if (!this->Write(indexEnd_, block)) return false;
-
-		// Move block to index if necessary
-		if (index < indexEnd_-1) return this->Move(indexEnd_-1, index);
-		else return true;
+		// Blocks from index onwards are shifted by one position.
+		image_.resize(indexEnd_*blockSize_);
+		image_.insert(image_.begin()+index*blockSize_, block, block+blockSize_);
+		++indexEnd_;
+		fileSize_ = indexEnd_ * blockSize_;
+		dirty_.resize(indexEnd_);
+		fill(dirty_.begin()+index, dirty_.end(), true);
+		return true;
 	}
 	else 
 	{
@@ -199,32 +367,8 @@ bool Block::Erase(size_t index)
 // EXPLAIN: index is from [0..].
 // PROMISE: Return true if data are successfully erased, false if otherwise.
 {
-	if (!(mode_ & ios_base::out)) return false;
-	if (index < indexEnd_)
-	{
-		fileSize_ -= blockSize_;
-		indexEnd_ -= 1;
-		
-		// Read entire file except the block to be deleted into memory.
-		char* buffer = new char[fileSize_];
-		for (size_t i=0, j=0; i!=indexEnd_+1; ++i) 
-		{
-			file_.seekg(i*blockSize_);
-			if (i != index) 
-			{
-				file_.read(buffer+j*blockSize_, blockSize_);
-				++j;
-			}
-		}
-		file_.close();
-		file_.open(&*(filename_.begin()), ios_base::out | ios_base::trunc | ios_base::binary);
-		file_.write(buffer, fileSize_);	// Write the new file.
-		file_.close();
-		file_.open(&*(filename_.begin()), mode_ | ios_base::binary);
-		delete[] buffer;
-		return true;
-	}
-	else return false;
+	vector<size_t> indices(1, index);
+	return this->Erase(indices);
 }
 
 bool Block::Erase(vector<size_t>& indices)
@@ -234,46 +378,458 @@ bool Block::Erase(vector<size_t>& indices)
 {
 	if (!(mode_ & ios_base::out)) return false;
 
-	// Read entire file except the blocks to be deleted into memory.
-	size_t maxIndices = indices.size();
-	fileSize_ -= maxIndices*blockSize_;
-	char* buffer = new char[fileSize_];
-	for (size_t i=0, k=0; i!=indexEnd_; ++i) 
+	vector<size_t> erased(indices);
+	sort(erased.begin(), erased.end());
+	erased.erase(unique(erased.begin(), erased.end()), erased.end());
+	if (erased.empty()) return true;
+	if (erased.back() >= indexEnd_) return false;
+
+	// Shift the remaining blocks down over the erased ones in a single pass.
+	// A shifted block only has to be written again if it differs from the block it replaces 
+	// or if either of them has not been written yet, since the file may still hold other data.
+	vector<char>::iterator image = image_.begin();
+	size_t maxErased = erased.size();
+	for (size_t i=0; i<maxErased; ++i)
+	{
+		size_t begin = erased[i] + 1;
+		size_t end = (i+1 < maxErased) ? erased[i+1] : indexEnd_;
+		for (size_t from=begin; from<end; ++from)
+		{
+			size_t to = from-i-1;
+			vector<char>::iterator source = image+from*blockSize_;
+			vector<char>::iterator target = image+to*blockSize_;
+			bool changed = !equal(source, source+blockSize_, target);
+			if (changed) copy(source, source+blockSize_, target);
+			dirty_[to] = dirty_[to] || dirty_[from] || changed;
+		}
+	}
+
+	indexEnd_ -= maxErased;
+	fileSize_ -= min(fileSize_, maxErased*blockSize_);
+	image_.resize(indexEnd_*blockSize_);
+	dirty_.resize(indexEnd_);
+	rewrite_ = true;
+	return true;
+}
+
+void Block::CopyTo(vector<char>& data) const
+// PURPOSE: Copy the whole contents of the opened block file to data.
+{
+	if (mode_ & ios_base::out) data.assign(image_.begin(), image_.begin()+fileSize_);
+	else if (mapping_) data.assign(mapping_, mapping_+fileSize_);
+	else data.clear();
+}
+
+void Block::SetAtomicSave(bool atomic, int syncPolicy)
+// PURPOSE: Choose whether files are saved in place or atomically, and how saved data are synchronised to disk.
+// EXPLAIN: syncPolicy is SYNC_NONE, SYNC_DATA (file data) or SYNC_FULL (file data, metadata and directory entry).
+// EXPLAIN: The setting applies to files created or opened afterwards and is kept when the file is closed.
+{
+	atomic_ = atomic;
+	syncPolicy_ = syncPolicy;
+}
+
+void Block::SetBlockSize(size_t size) 
+// PURPOSE: Change the size of the blocks the file is divided into.
+{
+	if (fileSize_) this->Flush();
+	blockSize_ = size;
+	indexEnd_ = fileSize_/blockSize_ + (fileSize_ % blockSize_ ? 1 : 0);
+	if (mode_ & ios_base::out)
+	{
+		image_.resize(indexEnd_*blockSize_, 0);
+		dirty_.assign(indexEnd_, false);
+	}
+}
+
+bool Block::Replace()
+// PURPOSE: Write the block image sequentially to a temporary file in the same directory, 
+// PURPOSE: synchronise it according to syncPolicy_ and rename it over the file named by filename_.
+// EXPLAIN: The temporary file takes the permissions and, where permitted, the owner of the file it replaces.
+// PROMISE: Return true if the file is successfully replaced, false if otherwise.
+// PROMISE: The original file is left untouched if writing the temporary file fails.
+{
+	const char* name = &*(filename_.begin());
+	const char* data = image_.empty() ? 0 : &*(image_.begin());
+	char suffix[32];
+#ifdef _WIN32
+	sprintf(suffix, ".%lu.tmp", (unsigned long)GetCurrentProcessId());
+	string temp = string(name) + suffix;
+	HANDLE file = CreateFileA(temp.c_str(), GENERIC_WRITE, 0, 0, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	bool written = true;
+	for (size_t offset=0; written && offset<fileSize_; )
+	{
+		DWORD bytes = (DWORD)min(fileSize_-offset, (size_t)(1<<30));
+		DWORD done = 0;
+		written = WriteFile(file, data+offset, bytes, &done, 0) && done == bytes;
+		offset += done;
+	}
+	if (written && syncPolicy_ != SYNC_NONE) written = FlushFileBuffers(file) != 0;
+	CloseHandle(file);
+
+	// ReplaceFile keeps the attributes and access control lists of an existing file.
+	bool replaced = written;
+	if (replaced && GetFileAttributesA(name) != INVALID_FILE_ATTRIBUTES)
+	{
+		replaced = ReplaceFileA(name, temp.c_str(), 0, REPLACEFILE_IGNORE_MERGE_ERRORS, 0, 0) != 0;
+	}
+	else if (replaced)
 	{
-		file_.seekg(i*blockSize_);
-		bool toDelete = false;
-		for (size_t j=0; j<maxIndices; ++j)
+		DWORD flags = MOVEFILE_REPLACE_EXISTING | (syncPolicy_ == SYNC_FULL ? MOVEFILE_WRITE_THROUGH : 0);
+		replaced = MoveFileExA(temp.c_str(), name, flags) != 0;
+	}
+	if (!replaced)
+	{
+		DeleteFileA(temp.c_str());
+		return false;
+	}
+	return true;
+#else
+	// A temporary file replacing an existing file is only readable by its creator until 
+	// it has the permissions of the existing file.
+	struct stat target;
+	bool exists = stat(name, &target) == 0;
+	string temp;
+	int file = -1;
+	for (int attempt=0; file == -1 && attempt < 100; ++attempt)
+	{
+		sprintf(suffix, ".%ld.%d.tmp", (long)getpid(), attempt);
+		temp = string(name) + suffix;
+		file = open(temp.c_str(), O_WRONLY | O_CREAT | O_EXCL, exists ? 0600 : 0666);
+		if (file == -1 && errno != EEXIST) return false;
+	}
+	if (file == -1) return false;
+
+	bool written = true;
+	for (size_t offset=0; written && offset<fileSize_; )
+	{
+		ssize_t done = write(file, data+offset, fileSize_-offset);
+		if (done < 0 && errno == EINTR) continue;
+		written = done > 0;
+		if (written) offset += done;
+	}
+	if (written && exists)
+	{
+		// Set after writing, which clears the set-user-ID and set-group-ID bits.
+		// Keep the owner and group if permitted, or else at least the group if the user belongs to it.
+		// Group permissions are dropped if the group cannot be kept, so that no other group gains access.
+		mode_t mode = target.st_mode & 07777;
+		if (fchown(file, target.st_uid, target.st_gid) != 0 && fchown(file, (uid_t)-1, target.st_gid) != 0)
 		{
-			if (i == indices[j])
-			{
-				toDelete = true;
-				break;
-			}
+			mode &= ~(mode_t)(S_ISGID | S_IRWXG);
 		}
-		if (!toDelete) 
+		written = fchmod(file, mode) == 0;
+	}
+	if (written && syncPolicy_ == SYNC_DATA)
+	{
+#if defined(__APPLE__)
+		written = fsync(file) == 0;
+#else
+		written = fdatasync(file) == 0;
+#endif
+	}
+	else if (written && syncPolicy_ == SYNC_FULL)
+	{
+#if defined(__APPLE__)
+		written = fcntl(file, F_FULLFSYNC) != -1 || fsync(file) == 0;
+#else
+		written = fsync(file) == 0;
+#endif
+	}
+	if (close(file) != 0) written = false;
+
+	if (!written || rename(temp.c_str(), name) != 0)
+	{
+		unlink(temp.c_str());
+		return false;
+	}
+
+	if (syncPolicy_ == SYNC_FULL)
+	{
+		// Make the rename itself durable by synchronising the directory.
+		string directory(name);
+		size_t slash = directory.rfind('/');
+		directory = (slash == string::npos) ? "." : (slash == 0 ? "/" : directory.substr(0, slash));
+		int dir = open(directory.c_str(), O_RDONLY);
+		if (dir != -1)
 		{
-			file_.read(buffer+k*blockSize_, blockSize_);
-			++k;
+			fsync(dir);
+			close(dir);
 		}
 	}
-	indexEnd_ -= maxIndices;
-	
-	file_.close();
-	file_.open(&*(filename_.begin()), ios_base::out | ios_base::trunc | ios_base::binary);
-	file_.write(buffer, fileSize_);	// Write the new file.
-	file_.close();
-	file_.open(&*(filename_.begin()), mode_ | ios_base::binary);
-	delete[] buffer;
 	return true;
+#endif
+}
+
+bool Block::Truncate()
+// PURPOSE: Cut the file named by filename_ down to fileSize_ bytes after blocks were erased.
+// PROMISE: Return true if the file is successfully truncated, false if otherwise.
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(&*(filename_.begin()), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, 0, 
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	size.QuadPart = fileSize_;
+	bool truncated = SetFilePointerEx(file, size, 0, FILE_BEGIN) && SetEndOfFile(file);
+	CloseHandle(file);
+	return truncated;
+#else
+	int result;
+	do result = truncate(&*(filename_.begin()), fileSize_);
+	while (result == -1 && errno == EINTR);
+	return result == 0;
+#endif
+}
+
+bool Block::Map()
+// PURPOSE: Memory map the whole file named by filename_ for reading.
+// PROMISE: Return true and set mapping_ and fileSize_ if file is successfully mapped, false if otherwise.
+{
+#ifdef _WIN32
+	HANDLE file = CreateFileA(&*(filename_.begin()), GENERIC_READ, FILE_SHARE_READ, 0, 
+							  OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	CloseHandle(file);
+	if (mapping == 0) return false;
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);	// The view keeps the mapping alive.
+	if (view == 0) return false;
+
+	mapping_ = static_cast<const char*>(view);
+	fileSize_ = static_cast<size_t>(size.QuadPart);
+	return true;
+#else
+	int file = open(&*(filename_.begin()), O_RDONLY);
+	if (file == -1) return false;
+
+	struct stat status;
+	if (fstat(file, &status) != 0 || status.st_size == 0)
+	{
+		close(file);
+		return false;
+	}
+
+	void* view = mmap(0, status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+	close(file);	// The mapping stays valid after the descriptor is closed.
+	if (view == MAP_FAILED) return false;
+
+	mapping_ = static_cast<const char*>(view);
+	fileSize_ = status.st_size;
+	return true;
+#endif
+}
+
+void Block::Unmap()
+// PURPOSE: Release the memory mapping of the file if there is one.
+{
+	if (mapping_ == 0) return;
+	if (filename_.empty())
+	{
+		// Buffers given to Open(data, size) are not owned by the block file.
+		mapping_ = 0;
+		return;
+	}
+#ifdef _WIN32
+	UnmapViewOfFile(mapping_);
+#else
+	munmap(const_cast<char*>(mapping_), fileSize_);
+#endif
+	mapping_ = 0;
 }
 /********************************** End of Class Block ***************************************/
 
+/********************************** Start of Class LittleEndian ******************************/
+void LittleEndian::ReadString(const char* buffer, wchar_t* str, int pos, int bytes)
+{
+#ifdef LITTLE_ENDIAN_HOST
+	if (sizeof(wchar_t) == SIZEOFWCHAR_T)
+	{
+		if (bytes > 0) memcpy(str, buffer+pos, bytes*sizeof(wchar_t));
+		return;
+	}
+	if (SIZEOFWCHAR_T == 2)
+	{
+		// Widen 16 bit characters to a wider wchar_t.
+		const char* units = buffer+pos;
+		size_t count = bytes > 0 ? bytes : 0;
+		size_t i = 0;
+	#ifdef SIMD_AVX2
+		for (; i+8<=count; i+=8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(units+i*2));
+			_mm256_storeu_si256((__m256i*)(str+i), _mm256_cvtepu16_epi32(v));
+		}
+	#endif
+	#ifdef SIMD_SSE2
+		__m128i zero = _mm_setzero_si128();
+		for (; i+8<=count; i+=8)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(units+i*2));
+			_mm_storeu_si128((__m128i*)(str+i), _mm_unpacklo_epi16(v, zero));
+			_mm_storeu_si128((__m128i*)(str+i+4), _mm_unpackhi_epi16(v, zero));
+		}
+	#endif
+		for (; i<count; ++i) 
+		{
+			unsigned short c;
+			memcpy(&c, units+i*2, 2);
+			str[i] = c;
+		}
+		return;
+	}
+#endif
+	for (int i=0; i<bytes; ++i) Read(buffer, str[i], pos+i*SIZEOFWCHAR_T);
+}
+
+void LittleEndian::WriteString(char* buffer, wchar_t* str, int pos, int bytes)
+{
+#ifdef LITTLE_ENDIAN_HOST
+	if (sizeof(wchar_t) == SIZEOFWCHAR_T)
+	{
+		if (bytes > 0) memcpy(buffer+pos, str, bytes*sizeof(wchar_t));
+		return;
+	}
+	if (SIZEOFWCHAR_T == 2)
+	{
+		// Narrow a wider wchar_t to 16 bit characters.
+		char* units = buffer+pos;
+		size_t count = bytes > 0 ? bytes : 0;
+		size_t i = 0;
+	#ifdef SIMD_SSE2
+		for (; i+8<=count; i+=8)
+		{
+			// Sign extend the low 16 bits so that the saturating pack keeps them unchanged.
+			__m128i a = _mm_loadu_si128((const __m128i*)(str+i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(str+i+4));
+			a = _mm_srai_epi32(_mm_slli_epi32(a, 16), 16);
+			b = _mm_srai_epi32(_mm_slli_epi32(b, 16), 16);
+			_mm_storeu_si128((__m128i*)(units+i*2), _mm_packs_epi32(a, b));
+		}
+	#endif
+		for (; i<count; ++i) 
+		{
+			unsigned short c = (unsigned short)str[i];
+			memcpy(units+i*2, &c, 2);
+		}
+		return;
+	}
+#endif
+	for (int i=0; i<bytes; ++i) Write(buffer, str[i], pos+i*SIZEOFWCHAR_T);
+}
+
+void LittleEndian::Widen(const char* buffer, wchar_t* str, size_t size)
+// PURPOSE: Convert size 8 bit characters in buffer to wide characters in str.
+// EXPLAIN: 8 bit characters are Latin-1, as in compressed Excel strings, so each is zero extended.
+{
+	const unsigned char* bytes = reinterpret_cast<const unsigned char*>(buffer);
+	size_t i = 0;
+#ifdef SIMD_AVX2
+	if (sizeof(wchar_t) == 2)
+	{
+		for (; i+16<=size; i+=16)
+		{
+			__m128i v = _mm_loadu_si128((const __m128i*)(bytes+i));
+			_mm256_storeu_si256((__m256i*)(str+i), _mm256_cvtepu8_epi16(v));
+		}
+	}
+	else
+	{
+		for (; i+8<=size; i+=8)
+		{
+			__m128i v = _mm_loadl_epi64((const __m128i*)(bytes+i));
+			_mm256_storeu_si256((__m256i*)(str+i), _mm256_cvtepu8_epi32(v));
+		}
+	}
+#elif defined(SIMD_SSE2)
+	__m128i zero = _mm_setzero_si128();
+	for (; i+16<=size; i+=16)
+	{
+		__m128i v = _mm_loadu_si128((const __m128i*)(bytes+i));
+		__m128i lo = _mm_unpacklo_epi8(v, zero);
+		__m128i hi = _mm_unpackhi_epi8(v, zero);
+		if (sizeof(wchar_t) == 2)
+		{
+			_mm_storeu_si128((__m128i*)(str+i), lo);
+			_mm_storeu_si128((__m128i*)(str+i+8), hi);
+		}
+		else
+		{
+			_mm_storeu_si128((__m128i*)(str+i), _mm_unpacklo_epi16(lo, zero));
+			_mm_storeu_si128((__m128i*)(str+i+4), _mm_unpackhi_epi16(lo, zero));
+			_mm_storeu_si128((__m128i*)(str+i+8), _mm_unpacklo_epi16(hi, zero));
+			_mm_storeu_si128((__m128i*)(str+i+12), _mm_unpackhi_epi16(hi, zero));
+		}
+	}
+#endif
+	for (; i<size; ++i) str[i] = bytes[i];
+}
+
+void LittleEndian::Narrow(const wchar_t* str, char* buffer, size_t size)
+// PURPOSE: Convert size wide characters in str to 8 bit characters in buffer.
+// REQUIRE: Every character fits in 8 bits, see FitsLatin1().
+{
+	size_t i = 0;
+#ifdef SIMD_SSE2
+	if (sizeof(wchar_t) == 2)
+	{
+		for (; i+16<=size; i+=16)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)(str+i));
+			__m128i b = _mm_loadu_si128((const __m128i*)(str+i+8));
+			_mm_storeu_si128((__m128i*)(buffer+i), _mm_packus_epi16(a, b));
+		}
+	}
+	else
+	{
+		for (; i+16<=size; i+=16)
+		{
+			__m128i a = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(str+i)), _mm_loadu_si128((const __m128i*)(str+i+4)));
+			__m128i b = _mm_packs_epi32(_mm_loadu_si128((const __m128i*)(str+i+8)), _mm_loadu_si128((const __m128i*)(str+i+12)));
+			_mm_storeu_si128((__m128i*)(buffer+i), _mm_packus_epi16(a, b));
+		}
+	}
+#endif
+	for (; i<size; ++i) buffer[i] = (char)str[i];
+}
+
+bool LittleEndian::FitsLatin1(const wchar_t* str, size_t size)
+// PURPOSE: Check whether size wide characters in str can be stored as 8 bit characters.
+// PROMISE: Returns true if no character is above 0xFF.
+{
+	size_t i = 0;
+#ifdef SIMD_SSE2
+	{
+		__m128i high = (sizeof(wchar_t) == 2) ? _mm_set1_epi16((short)0xFF00) : _mm_set1_epi32((int)0xFFFFFF00);
+		__m128i any = _mm_setzero_si128();
+		size_t step = 16 / sizeof(wchar_t);
+		for (; i+step<=size; i+=step) any = _mm_or_si128(any, _mm_and_si128(_mm_loadu_si128((const __m128i*)(str+i)), high));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF) return false;
+	}
+#endif
+	for (; i<size; ++i) if ((unsigned long)str[i] > 0xFF) return false;
+	return true;
+}
+/********************************** End of Class LittleEndian ********************************/
+
 /********************************** Start of Class Header ************************************/
 // PURPOSE: Read and write data to a compound file header.
-CompoundFile::Header::Header() : 
+CompoundFile::Header::Header(int version) : 
 	fileType_(0xE11AB1A1E011CFD0LL),
-	uk1_(0), uk2_(0), uk3_(0), uk4_(0), uk5_(0x003B), uk6_(0x0003), uk7_(-2),
-	log2BigBlockSize_(9), log2SmallBlockSize_(6), 
+	uk1_(0), uk2_(0), uk3_(0), uk4_(0), uk5_(0x003B), uk6_(version == 4 ? 4 : 3), uk7_(-2),
+	log2BigBlockSize_(version == 4 ? 12 : 9), log2SmallBlockSize_(6), 
 	uk8_(0), uk9_(0), uk10_(0), uk11_(0x00001000),
 	SBATStart_(-2), SBATCount_(0),
 	XBATStart_(-2), XBATCount_(0),
@@ -308,7 +864,7 @@ void CompoundFile::Header::Write(char* block)
 	LittleEndian::Write(block, SBATCount_, 0x0040, 4);
 	LittleEndian::Write(block, XBATStart_, 0x0044, 4);
 	LittleEndian::Write(block, XBATCount_, 0x0048, 4);
-	for (size_t i=0; i<109; ++i) LittleEndian::Write(block, BATArray_[i], 0x004C+i*4, 4);
+	LittleEndian::WriteString(block, BATArray_, 0x004C, 109);
 }
 
 void CompoundFile::Header::Read(char* block)
@@ -335,7 +891,7 @@ void CompoundFile::Header::Read(char* block)
 	LittleEndian::Read(block, SBATCount_, 0x0040, 4);
 	LittleEndian::Read(block, XBATStart_, 0x0044, 4);
 	LittleEndian::Read(block, XBATCount_, 0x0048, 4);
-	for (size_t i=0; i<109; ++i) LittleEndian::Read(block, BATArray_[i], 0x004C+i*4, 4);
+	LittleEndian::ReadString(block, BATArray_, 0x004C, 109);
 	Initialize();		
 }
 
@@ -416,34 +972,114 @@ CompoundFile::PropertyTree::~PropertyTree()
 	size_t maxChildren = children_.size();
 	for (size_t i=0; i<maxChildren; ++i) delete children_[i];
 }
+
+size_t CompoundFile::PropertyTree::NameHash(const wchar_t* name)
+// PURPOSE: Calculate a hash of a property name which ignores the case of ASCII letters.
+{
+	size_t hash = 2166136261U;
+	for (; *name; ++name)
+	{
+		wchar_t c = *name;
+		if (c >= L'a' && c <= L'z') c -= L'a' - L'A';
+		hash = (hash ^ (size_t)c) * 16777619U;
+	}
+	return hash;
+}
+
+void CompoundFile::PropertyTree::IndexChild(PropertyTree* child)
+// PURPOSE: Add a child to the name index of this property tree.
+// EXPLAIN: The index is rebuilt with twice the number of buckets when it holds more children than buckets.
+{
+	if (children_.size() > childrenIndex_.size())
+	{
+		childrenIndex_.assign(max((size_t)8, childrenIndex_.size()*2), vector<PropertyTree*>());
+		size_t maxChildren = children_.size();
+		for (size_t i=0; i<maxChildren; ++i) 
+		{
+			if (children_[i] == child) continue;
+			childrenIndex_[NameHash(children_[i]->self_->name_) & (childrenIndex_.size()-1)].push_back(children_[i]);
+		}
+	}
+	childrenIndex_[NameHash(child->self_->name_) & (childrenIndex_.size()-1)].push_back(child);
+}
+
+void CompoundFile::PropertyTree::UnindexChild(PropertyTree* child)
+// PURPOSE: Remove a child from the name index of this property tree.
+{
+	if (childrenIndex_.empty()) return;
+	vector<PropertyTree*>& bucket = childrenIndex_[NameHash(child->self_->name_) & (childrenIndex_.size()-1)];
+	bucket.erase(remove(bucket.begin(), bucket.end(), child), bucket.end());
+}
+
+CompoundFile::PropertyTree* CompoundFile::PropertyTree::FindChild(const wchar_t* name) const
+// PURPOSE: Find a child of this property tree by its name.
+// EXPLAIN: Names are hashed without case but compared exactly.
+// PROMISE: Returns a pointer to the child's property tree if present, 0 if otherwise.
+{
+	if (childrenIndex_.empty()) return 0;
+	const vector<PropertyTree*>& bucket = childrenIndex_[NameHash(name) & (childrenIndex_.size()-1)];
+	size_t maxChildren = bucket.size();
+	for (size_t i=0; i<maxChildren; ++i)
+	{
+		if (wcscmp(bucket[i]->self_->name_, name) == 0) return bucket[i];
+	}
+	return 0;
+}
 /********************************** End of Class PropertyTree ************************************/
 
 /********************************** Start of Class CompoundFile ******************************/
 // PURPOSE: Manage a compound file.
 CompoundFile::CompoundFile() :
-	block_(512), properties_(0), propertyTrees_(0),
-	blocksIndices_(0), sblocksIndices_(0) {};
+	block_(512), transactionDepth_(0), metadataChanged_(false),
+	blocksIndices_(0), sblocksIndices_(0), allocationPolicy_(COMPACT),
+	miniStreamLoaded_(false), propertyTrees_(0), properties_(0) {};
 
 CompoundFile::~CompoundFile() {this->Close();}
 
 /************************* Compound File Functions ***************************/
-bool CompoundFile::Create(const wchar_t* filename)
+bool CompoundFile::Create(const wchar_t* filename, int version)
 // PURPOSE: Create a new compound file and open it.
 // PURPOSE: If file is present, truncate it and then open it.
+// EXPLAIN: version is 3 for 512 byte big blocks or 4 for 4096 byte big blocks.
 // PROMISE: Return true if file is successfully created and opened, false if otherwise.
 {
 	Close();
 	file_.Create(filename);
+	NewFile(version);
+	return true;
+}
+
+bool CompoundFile::Create(int version)
+// PURPOSE: Create a new compound file which is held only in memory.
+// EXPLAIN: version is 3 for 512 byte big blocks or 4 for 4096 byte big blocks.
+// EXPLAIN: The compound file can be copied out with SaveToBuffer().
+// PROMISE: Return true if the compound file is successfully created, false if otherwise.
+{
+	Close();
+	if (!file_.Create()) return false;
+	NewFile(version);
+	return true;
+}
 
+void CompoundFile::NewFile(int version)
+// PURPOSE: Write the header, BAT and root entry of a new empty compound file.
+// EXPLAIN: version is 3 for 512 byte big blocks or 4 for 4096 byte big blocks.
+{
 	// Write compound file header
-	header_ = Header();
+	header_ = Header(version);
+	block_.resize(header_.bigBlockSize_);
+	file_.SetBlockSize(header_.bigBlockSize_);
 	SaveHeader();
 
 	// Save BAT
 	blocksIndices_.clear();
-	blocksIndices_.resize(128, -1);
+	blocksIndices_.resize(header_.bigBlockSize_/4, -1);
 	blocksIndices_[0] = -3;
+	BATIndices_.assign(1, 0);
+	XBATIndices_.clear();
 	blocksIndices_[1] = -2;
+	FindFreeBlocks(true);
+	FindFreeBlocks(false);
 	SaveBAT();
 
 	// Save properties
@@ -459,8 +1095,6 @@ bool CompoundFile::Create(const wchar_t* filename)
 	propertyTrees_->self_ = properties_[0];
 	propertyTrees_->index_ = 0;
 	currentDirectory_ = propertyTrees_;
-
-	return true;
 }
 
 bool CompoundFile::Open(const wchar_t* filename, ios_base::openmode mode)
@@ -469,7 +1103,33 @@ bool CompoundFile::Open(const wchar_t* filename, ios_base::openmode mode)
 {
 	Close();
 	if (!file_.Open(filename, mode)) return false;
-	
+	return LoadFile();
+}
+
+bool CompoundFile::OpenMemory(const char* data, size_t size)
+// PURPOSE: Open a compound file held in a memory buffer for reading.
+// EXPLAIN: The buffer is read in place without copying. It must stay valid until the compound file is closed.
+// PROMISE: Return true if file is successfully opened, false if otherwise.
+{
+	Close();
+	if (!file_.Open(data, size)) return false;
+	return LoadFile();
+}
+
+bool CompoundFile::SaveToBuffer(vector<char>& data)
+// PURPOSE: Copy the whole opened compound file to data.
+// EXPLAIN: Metadata changed in a transaction which is not yet committed is not included.
+// PROMISE: Return true if the compound file is successfully copied, false if otherwise.
+{
+	if (!file_.IsOpen()) return false;
+	file_.CopyTo(data);
+	return true;
+}
+
+bool CompoundFile::LoadFile()
+// PURPOSE: Load the header, BAT and properties of the opened compound file.
+// PROMISE: Return true if they are successfully loaded, false if otherwise.
+{
 	// Load header
 	if (!LoadHeader()) return false;
 
@@ -487,10 +1147,26 @@ bool CompoundFile::Open(const wchar_t* filename, ios_base::openmode mode)
 bool CompoundFile::Close()
 // PURPOSE: Close the opened compound file.
 // PURPOSE: Reset BAT indices, SBAT indices, properties and properties tree information.
+// EXPLAIN: Metadata changed in a transaction which is not yet committed is saved first.
 // PROMISE: Return true if file is successfully closed, false if otherwise.
 {
+	if (transactionDepth_ != 0)
+	{
+		transactionDepth_ = 1;
+		CommitTransaction();
+	}
+	metadataChanged_ = false;
+
 	blocksIndices_.clear();
 	sblocksIndices_.clear();
+	BATIndices_.clear();
+	XBATIndices_.clear();
+	InvalidateBlockChains(true);
+	InvalidateBlockChains(false);
+	freeBlocksIndices_.clear();
+	freeSBlocksIndices_.clear();
+	miniStream_.clear();
+	miniStreamLoaded_ = false;
 
 	size_t maxProperties = properties_.size();
 	for (size_t i=0; i<maxProperties; ++i)
@@ -518,6 +1194,167 @@ bool CompoundFile::IsOpen()
 	return file_.IsOpen();
 }
 
+void CompoundFile::BeginTransaction()
+// PURPOSE: Start a transaction in which header, BAT and properties are not saved after each change.
+// EXPLAIN: Transactions may be nested. Metadata is saved once when the outermost transaction is committed.
+{
+	++transactionDepth_;
+}
+
+bool CompoundFile::CommitTransaction()
+// PURPOSE: End a transaction started by BeginTransaction().
+// PROMISE: If it is the outermost transaction, save changed metadata and write all buffered changes to the file.
+// PROMISE: Return true if the changes are successfully written, false if otherwise.
+{
+	if (transactionDepth_ == 0) return false;
+	if (--transactionDepth_ != 0) return true;
+	if (metadataChanged_) SaveMetadata();
+	return file_.Flush();
+}
+
+void CompoundFile::SetAllocationPolicy(int policy)
+// PURPOSE: Choose what happens to big blocks which are freed.
+// EXPLAIN: COMPACT erases freed blocks from the file, moving all blocks after them.
+// EXPLAIN: APPEND_ONLY only marks freed blocks free in the BAT for later reuse, so existing blocks never move.
+// EXPLAIN: New blocks, including BAT and XBAT blocks, come from free blocks or the end of the file under either policy.
+// EXPLAIN: The policy is kept when the compound file is closed and reopened.
+{
+	allocationPolicy_ = policy;
+}
+
+void CompoundFile::SetAtomicSave(bool atomic, int syncPolicy)
+// PURPOSE: Choose whether compound files are saved in place or atomically.
+// EXPLAIN: An atomically saved file is written sequentially to a temporary file in the same 
+// EXPLAIN: directory, synchronised according to syncPolicy and renamed over the compound file.
+// EXPLAIN: The setting is kept when the compound file is closed and reopened.
+{
+	file_.SetAtomicSave(atomic, syncPolicy);
+}
+
+bool CompoundFile::Compact()
+// PURPOSE: Rewrite the compound file so that every stream occupies one contiguous run of blocks.
+// EXPLAIN: The SBAT blocks come first, followed by the property table, the mini stream and the big 
+// EXPLAIN: block streams in the order of their properties. Small block streams are packed at the start 
+// EXPLAIN: of the mini stream in the same order. The BAT and XBAT blocks come last, so that BAT blocks 
+// EXPLAIN: trimmed when a stream later shrinks do not move any stream. Free blocks are removed.
+// PROMISE: Return true if the compound file is successfully compacted, false if otherwise.
+{
+	if (!file_.IsOpen() || file_.IsReadOnly()) return false;
+
+	// Read the data of all streams before any block is overwritten
+	size_t maxProperties = properties_.size();
+	vector<vector<char> > data(maxProperties);
+	{for (size_t i=1; i<maxProperties; ++i)
+	{
+		Property* property = properties_[i];
+		if (property->propertyType_ != 2 || property->size_ == 0) continue;
+		data[i].resize(property->size_);
+		ReadData(property->startBlock_, &*(data[i].begin()), property->size_ >= 4096, property->size_);
+	}}
+
+	// Count the blocks needed by each part of the compound file
+	size_t bigBlockSize = header_.bigBlockSize_;
+	size_t smallBlockSize = header_.smallBlockSize_;
+	size_t entriesPerBlock = bigBlockSize / 4;
+	size_t smallBlocks = 0;
+	size_t streamBlocks = 0;
+	{for (size_t i=1; i<maxProperties; ++i)
+	{
+		size_t size = data[i].size();
+		if (size >= 4096) streamBlocks += (size+bigBlockSize-1) / bigBlockSize;
+		else smallBlocks += (size+smallBlockSize-1) / smallBlockSize;
+	}}
+	size_t miniStreamSize = smallBlocks*smallBlockSize;
+	size_t miniStreamBlocks = (miniStreamSize+bigBlockSize-1) / bigBlockSize;
+	size_t SBATBlocks = (smallBlocks+entriesPerBlock-1) / entriesPerBlock;
+	size_t propertiesPerBlock = bigBlockSize / 128;
+	size_t propertyBlocks = (maxProperties+propertiesPerBlock-1) / propertiesPerBlock;
+	size_t usedBlocks = SBATBlocks + propertyBlocks + miniStreamBlocks + streamBlocks;
+
+	// The BAT must also hold the entries of its own blocks and of the XBAT blocks
+	size_t BATBlocks = 1;
+	size_t XBATBlocks = 0;
+	for (;;)
+	{
+		XBATBlocks = BATBlocks > 109 ? (BATBlocks-109+entriesPerBlock-2) / (entriesPerBlock-1) : 0;
+		size_t totalBlocks = BATBlocks + XBATBlocks + usedBlocks;
+		size_t neededBATBlocks = (totalBlocks+entriesPerBlock-1) / entriesPerBlock;
+		if (neededBATBlocks <= BATBlocks) break;
+		BATBlocks = neededBATBlocks;
+	}
+
+	// Lay out all blocks and rebuild the BAT
+	InvalidateBlockChains(true);
+	InvalidateBlockChains(false);
+	blocksIndices_.assign(BATBlocks*entriesPerBlock, -1);
+	size_t nextIndex = 0;
+	header_.SBATCount_ = SBATBlocks;
+	header_.SBATStart_ = LinkRun(nextIndex, SBATBlocks, true);
+	header_.propertiesStart_ = LinkRun(nextIndex, propertyBlocks, true);
+	properties_[0]->startBlock_ = LinkRun(nextIndex, miniStreamBlocks, true);
+	properties_[0]->size_ = miniStreamSize;
+
+	// Lay out the streams and rebuild the SBAT and the mini stream
+	sblocksIndices_.assign(SBATBlocks*entriesPerBlock, -1);
+	miniStream_.assign(miniStreamSize, 0);
+	miniStreamLoaded_ = true;
+	size_t nextSmallIndex = 0;
+	{for (size_t i=1; i<maxProperties; ++i)
+	{
+		size_t size = data[i].size();
+		if (properties_[i]->propertyType_ != 2) continue;
+		if (size >= 4096) 
+		{
+			properties_[i]->startBlock_ = LinkRun(nextIndex, (size+bigBlockSize-1) / bigBlockSize, true);
+		}
+		else
+		{
+			if (size) copy (data[i].begin(), data[i].end(), miniStream_.begin()+nextSmallIndex*smallBlockSize);
+			properties_[i]->startBlock_ = LinkRun(nextSmallIndex, (size+smallBlockSize-1) / smallBlockSize, false);
+		}
+	}}
+	BATIndices_.clear();
+	XBATIndices_.clear();
+	{for (size_t i=0; i<BATBlocks; ++i)
+	{
+		BATIndices_.push_back(nextIndex);
+		blocksIndices_[nextIndex++] = -3;
+	}}
+	{for (size_t i=0; i<XBATBlocks; ++i)
+	{
+		XBATIndices_.push_back(nextIndex);
+		blocksIndices_[nextIndex++] = -4;
+	}}
+	FindFreeBlocks(true);
+	FindFreeBlocks(false);
+
+	// Write all blocks in their new locations and remove the rest of the file
+	{for (size_t i=1; i<maxProperties; ++i)
+	{
+		size_t size = data[i].size();
+		if (size >= 4096) WriteData(&*(data[i].begin()), size, properties_[i]->startBlock_, true);
+	}}
+	if (miniStreamSize) SaveMiniStream();
+	SaveProperties();
+	SaveBAT();
+	SaveHeader();
+	metadataChanged_ = false;
+
+	vector<size_t> indicesToRemove;
+	{for (size_t i=nextIndex+1; i<file_.GetBlockCount(); ++i) indicesToRemove.push_back(i);}	// Add 1 because Block index 1 corresponds to index 0 here
+	if (!indicesToRemove.empty()) file_.Erase(indicesToRemove);
+
+	if (transactionDepth_ != 0) return true;
+	return file_.Flush();
+}
+
+bool CompoundFile::Flush()
+// PURPOSE: Write all buffered changes to the compound file.
+// PROMISE: Return true if changes are successfully written, false if otherwise.
+{
+	return file_.Flush();
+}
+
 /************************* Directory Functions ***************************/
 int CompoundFile::ChangeDirectory(const wchar_t* path)
 // PURPOSE: Change to a different directory in the compound file.
@@ -598,9 +1435,7 @@ int CompoundFile::MakeDirectory(const wchar_t* path)
 	int ret = MakeProperty(path, property);
 	currentDirectory_ = previousDirectories_.back();
 	previousDirectories_.pop_back();
-	SaveHeader();
-	SaveBAT();
-	SaveProperties();
+	SaveMetadata();
 	return ret;
 }
 
@@ -661,9 +1496,7 @@ int CompoundFile::RemoveDirectory(const wchar_t* path)
 	if (directory == 0) return DIRECTORY_NOT_FOUND;
 	if (directory->self_->childProp_ != -1) return DIRECTORY_NOT_EMPTY;
 	DeletePropertyTree(directory);
-	SaveHeader();
-	SaveBAT();
-	SaveProperties();
+	SaveMetadata();
 	return SUCCESS;
 }
 
@@ -747,25 +1580,19 @@ int CompoundFile::MakeFile(const wchar_t* path)
 	int ret = MakeProperty(path, property);
 	currentDirectory_ = previousDirectories_.back();
 	previousDirectories_.pop_back();
-	SaveHeader();
-	SaveBAT();
-	SaveProperties();
+	SaveMetadata();
 	return ret;
 }
 
 int CompoundFile::RemoveFile(const wchar_t* path)
 // PURPOSE: Remove a file in the compound file.
 {
+	BeginTransaction();
 	int ret = WriteFile(path, 0, 0);
-	if (ret == SUCCESS) 
-	{
-		DeletePropertyTree(FindProperty(path));
-		SaveHeader();
-		SaveBAT();
-		SaveProperties();
-		return SUCCESS;
-	}
-	else return ret;
+	if (ret == SUCCESS) DeletePropertyTree(FindProperty(path));
+	SaveMetadata();
+	CommitTransaction();
+	return ret;
 }
 
 int CompoundFile::FileSize(const wchar_t* path, size_t& size)
@@ -798,13 +1625,9 @@ int CompoundFile::ReadFile(const wchar_t* path, char* data)
 // PROMISE: data will not be set if file is not present in the compound file.
 {
 	// Special case of reading root entry
-	char* buffer;
 	if (wcscmp(path, L"\\") == 0)
 	{
-		buffer = new char[DataSize(propertyTrees_->self_->startBlock_, true)];
-		ReadData(propertyTrees_->self_->startBlock_, buffer, true);
-		copy (buffer, buffer+propertyTrees_->self_->size_, data);
-		delete[] buffer;
+		ReadData(propertyTrees_->self_->startBlock_, data, true, propertyTrees_->self_->size_);
 		return SUCCESS;
 	}
 
@@ -812,21 +1635,17 @@ int CompoundFile::ReadFile(const wchar_t* path, char* data)
 	PropertyTree* property = FindProperty(path);
 	if (property == 0) return FILE_NOT_FOUND;
 
+	// Only the actual file size is copied, so data need not hold the last block in full.
 	if (property->self_->size_ >= 4096)
 	{
 		// Data stored in normal big blocks
-		buffer = new char[DataSize(property->self_->startBlock_, true)];
-		ReadData(property->self_->startBlock_, buffer, true);
+		ReadData(property->self_->startBlock_, data, true, property->self_->size_);
 	}
 	else
 	{
 		// Data stored in small blocks
-		buffer = new char[DataSize(property->self_->startBlock_, false)];
-		ReadData(property->self_->startBlock_, buffer, false);
+		ReadData(property->self_->startBlock_, data, false, property->self_->size_);
 	}
-	// Truncated the retrieved data to the actual file size.
-	copy (buffer, buffer+property->self_->size_, data);
-	delete[] buffer;
 	return SUCCESS;
 }
 
@@ -870,9 +1689,7 @@ int CompoundFile::WriteFile(const wchar_t* path, const char* data, size_t size)
 		}
 	}
 	property->self_->size_ = size;
-	SaveHeader();
-	SaveBAT();
-	SaveProperties();
+	SaveMetadata();
 	return SUCCESS;
 }
 
@@ -884,13 +1701,13 @@ int CompoundFile::WriteFile(const wchar_t* path, const vector<char>& data, size_
 }
 
 /*************ANSI char compound file, directory and file functions******************/
-bool CompoundFile::Create(const char* filename)
+bool CompoundFile::Create(const char* filename, int version)
 {
 	size_t filenameLength = strlen(filename);
 	wchar_t* wname = new wchar_t[filenameLength+1];
 	mbstowcs(wname, filename, filenameLength);
 	wname[filenameLength] = 0;
-	bool ret = Create(wname);
+	bool ret = Create(wname, version);
 	delete[] wname;
 	return ret;
 }
@@ -1053,105 +1870,14 @@ int CompoundFile::WriteFile(const char* path, vector<char>& data, size_t size)
 }
 
 /*********************** Inaccessible General Functions ***************************/
-void CompoundFile::IncreaseLocationReferences(vector<size_t> indices)
-// PURPOSE: Increase block location references in header, BAT indices and properties,
-// PURPOSE: which will be affected by the insertion of new indices contained in indices.
-// PROMISE: Block location references which are smaller than all the new indices
-// PROMISE: will not be affected.
-// PROMISE: SBAT location references will not be affected.
-// PROMISE: Changes will not be written to compound file.
-{
-	size_t maxIndices = indices.size();
-
-	// Change BAT Array references
-	{for (size_t i=0; i<109 && header_.BATArray_[i]!=-1; ++i)
-	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (header_.BATArray_[i] >= indices[j] &&
-				header_.BATArray_[i] != -1) ++count;
-		}
-		header_.BATArray_[i] += count;	
-	}}
-
-	// Change XBAT start block if any
-	if (header_.XBATCount_) 
-	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (header_.XBATStart_ >= indices[j] &&
-				header_.XBATStart_ != -2) ++count;
-		}
-		header_.XBATStart_ += count;	
-	}
-
-	// Change SBAT start block if any
-	if (header_.SBATCount_) 
-	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (header_.SBATStart_ >= indices[j] &&
-				header_.SBATStart_ != -2) ++count;
-		}
-		header_.SBATStart_ += count;	
-	}
-
-	// Change BAT block indices
-	size_t maxBATindices = blocksIndices_.size();
-	{for (size_t i=0; i<maxBATindices && blocksIndices_[i]!=-1; ++i)
-	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (blocksIndices_[i] > indices[j] &&
-				blocksIndices_[i] != -2 && 
-				blocksIndices_[i] != -3) ++count;
-		}
-		blocksIndices_[i] += count;	
-	}}
-
-	// Change properties start block
-	size_t count = 0;
-	{for (size_t i=0; i<maxIndices; ++i)
-	{
-		if (header_.propertiesStart_ >= indices[i] &&
-			header_.propertiesStart_ != -2) ++count;
-	}}
-	header_.propertiesStart_ += count;
-
-	// Change individual properties start block if their size is more than 4096
-	size_t maxProperties = properties_.size();
-	if (!properties_.empty()) 
-	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (properties_[0]->startBlock_ >= indices[j] &&
-				properties_[0]->startBlock_ != -2) ++count;
-		}
-		properties_[0]->startBlock_ += count;	
-	}
-	{for (size_t i=1; i<maxProperties; ++i)
-	{
-		if (properties_[i]->size_ >= 4096)
-		{
-			size_t count = 0;
-			for (size_t j=0; j<maxIndices; ++j)
-			{
-				if (properties_[i]->startBlock_ >= indices[j] &&
-					properties_[i]->startBlock_ != -2) ++count;
-			}
-			properties_[i]->startBlock_ += count;	
-		}
-	}}
-}
-
-void CompoundFile::DecreaseLocationReferences(vector<size_t> indices)
+void CompoundFile::DecreaseLocationReferences(const vector<size_t>& indices, int* reference)
 // PURPOSE: Decrease block location references in header, BAT indices and properties,
 // PURPOSE: which will be affected by the deletion of indices contained in indices.
+// EXPLAIN: indices are sorted once, and the shift of each reference is the number of 
+// EXPLAIN: deleted indices before it, found by a binary search.
+// EXPLAIN: reference, if given, is a block index held by the caller, such as the start 
+// EXPLAIN: block of a stream being written, and is decreased in the same way.
+// PROMISE: The free list of big blocks is kept in step, including the BAT entries freed at its end.
 // PROMISE: BAT indices pointing to a deleted index will be redirected to point to 
 // PROMISE: the location where the deleted index original points to.
 // PROMISE: Block location references which are smaller than all the new indices
@@ -1159,121 +1885,91 @@ void CompoundFile::DecreaseLocationReferences(vector<size_t> indices)
 // PROMISE: SBAT location references will not be affected.
 // PROMISE: Changes will not be written to compound file.
 {
-	size_t maxIndices = indices.size();
+	InvalidateBlockChains(true);
+	vector<size_t> sorted(indices);
+	sort (sorted.begin(), sorted.end());
+	sorted.erase(unique(sorted.begin(), sorted.end()), sorted.end());
+	vector<size_t>::const_iterator first = sorted.begin();
+	vector<size_t>::const_iterator last = sorted.end();
 
-	// Change BAT Array references
-	{for (size_t i=0; i<109 && header_.BATArray_[i]!=-1; ++i)
+	// Change BAT and XBAT block locations
+	{for (size_t i=0; i<BATIndices_.size(); ++i)
 	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (header_.BATArray_[i] > indices[j] &&
-				header_.BATArray_[i] != -1) ++count;
-		}
-		header_.BATArray_[i] -= count;
+		BATIndices_[i] -= lower_bound(first, last, BATIndices_[i]) - first;
 	}}
-
-	// Change XBAT start block if any
-	if (header_.XBATCount_) 
+	{for (size_t i=0; i<XBATIndices_.size(); ++i)
 	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (header_.XBATStart_ > indices[j] &&
-				header_.XBATStart_ != -2) ++count;
-		}
-		header_.XBATStart_ -= count;
-	}
+		XBATIndices_[i] -= lower_bound(first, last, XBATIndices_[i]) - first;
+	}}
 
 	// Change SBAT start block if any
-	if (header_.SBATCount_) 
+	if (header_.SBATCount_ && header_.SBATStart_ != -2) 
 	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (header_.SBATStart_ > indices[j] &&
-				header_.SBATStart_ != -2) ++count;
-		}
-		header_.SBATStart_ -= count;
+		header_.SBATStart_ -= lower_bound(first, last, (size_t)header_.SBATStart_) - first;
 	}
 	
 	// Change BAT block indices
 	// Redirect BAT indices pointing to a deleted index to point to
 	// the location where the deleted index original points to.
 	size_t maxBATindices = blocksIndices_.size();
-	{for (size_t i=0; i<maxBATindices && blocksIndices_[i]!=-1; ++i)
+	{for (size_t i=0; i<maxBATindices; ++i)
 	{
-		bool end;
-		do
+		while (blocksIndices_[i] >= 0 && binary_search(first, last, (size_t)blocksIndices_[i]))
 		{
-			end = true;
-			for (size_t j=0; j<maxIndices; ++j)
-			{
-				if (blocksIndices_[i] == indices[j]) 
-				{
-					blocksIndices_[i] = blocksIndices_[indices[j]];
-					end = false;
-					break;
-				}
-			}		
-		} while (!end);
-	}}
-	// Erase indices to be deleted from the block indices
-	sort (indices.begin(), indices.end(), greater<size_t>());
-	{for (size_t i=0; i<maxIndices; ++i)
-	{
-		blocksIndices_.erase(blocksIndices_.begin()+indices[i]);
-		blocksIndices_.push_back(-1);
+			blocksIndices_[i] = blocksIndices_[blocksIndices_[i]];
+		}
 	}}
 
-	// Decrease block location references for affected block indices.
-	{for (size_t i=0; i<maxBATindices && blocksIndices_[i]!=-1; ++i)
+	// Erase indices to be deleted from the block indices in one pass
+	size_t maxIndices = 0;
+	{for (size_t i=0, j=0; i<maxBATindices; ++i)
 	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
+		if (j < sorted.size() && sorted[j] == i) 
 		{
-			if (blocksIndices_[i] > indices[j] &&
-				blocksIndices_[i] != -2 && 
-				blocksIndices_[i] != -3) ++count;
+			++j;
+			++maxIndices;
 		}
-		blocksIndices_[i] -= count;	
+		else blocksIndices_[i-maxIndices] = blocksIndices_[i];
 	}}
+	fill (blocksIndices_.end()-maxIndices, blocksIndices_.end(), -1);
 
-	// Change properties start block
-	size_t count = 0;
-	{for (size_t i=0; i<maxIndices; ++i)
+	// Decrease the free indices, which keeps them in descending order, 
+	// and add the entries freed at the end of the BAT in front of them.
+	{for (size_t i=0; i<freeBlocksIndices_.size(); ++i)
 	{
-		if (header_.propertiesStart_ > indices[i] &&
-			header_.propertiesStart_ != -2) ++count;
+		freeBlocksIndices_[i] -= lower_bound(first, last, freeBlocksIndices_[i]) - first;
 	}}
-	header_.propertiesStart_ -= count;
+	vector<size_t> freedIndices;
+	{for (size_t i=maxBATindices; i>maxBATindices-maxIndices; --i) freedIndices.push_back(i-1);}
+	freeBlocksIndices_.insert(freeBlocksIndices_.begin(), freedIndices.begin(), freedIndices.end());
 
-	size_t maxProperties = properties_.size();
-	// Change Root Entry start block
-	if (!properties_.empty()) 
+	// Decrease block location references for affected block indices.
+	{for (size_t i=0; i<maxBATindices; ++i)
 	{
-		size_t count = 0;
-		for (size_t j=0; j<maxIndices; ++j)
-		{
-			if (properties_[0]->startBlock_ > indices[j] &&
-				properties_[0]->startBlock_ != -2) ++count;
-		}
-		properties_[0]->startBlock_ -= count;	
+		if (blocksIndices_[i] < 0) continue;	// Free, end of chain or special block
+		blocksIndices_[i] -= lower_bound(first, last, (size_t)blocksIndices_[i]) - first;
+	}}
+
+	// Change properties start block
+	if (header_.propertiesStart_ != -2)
+	{
+		header_.propertiesStart_ -= lower_bound(first, last, (size_t)header_.propertiesStart_) - first;
 	}
-	{for (size_t i=1; i<maxProperties; ++i)
+
+	// Change Root Entry start block, and individual properties start block if their size is more than 4096
+	size_t maxProperties = properties_.size();
+	{for (size_t i=0; i<maxProperties; ++i)
 	{
-		if (properties_[i]->size_ >= 4096)
-		{
-			// Change individual properties start block if their size is more than 4096
-			size_t count = 0;
-			for (size_t j=0; j<maxIndices; ++j)
-			{
-				if (properties_[i]->startBlock_ > indices[j] &&
-					properties_[i]->startBlock_ != -2) ++count;
-			}
-			properties_[i]->startBlock_ -= count;	
-		}
+		if (i != 0 && properties_[i]->size_ < 4096) continue;	// Root Entry is always in big blocks
+		if (properties_[i]->startBlock_ == -2) continue;
+		properties_[i]->startBlock_ -= lower_bound(first, last, (size_t)properties_[i]->startBlock_) - first;
 	}}
+
+	// Change the caller's block location reference
+	if (reference && *reference >= 0)
+	{
+		*reference -= lower_bound(first, last, (size_t)*reference) - first;
+	}
 }
 
 void CompoundFile::SplitPath(const wchar_t* path, 
@@ -1326,81 +2022,140 @@ bool CompoundFile::LoadHeader()
 
 void CompoundFile::SaveHeader()
 // PURPOSE: Save header information for compound file.
+// EXPLAIN: The header is padded with zeros to a whole big block, which matters for 4096 byte blocks.
 {
+	fill (block_.begin(), block_.end(), 0);
 	header_.Write(&*(block_.begin()));
-	file_.Write(0, &*(block_.begin()));
+	WriteBlock(0, &*(block_.begin()));
+}
+
+void CompoundFile::SaveMetadata()
+// PURPOSE: Save properties, BAT and header information for compound file.
+// EXPLAIN: Properties are saved first because they may need new blocks, which changes the BAT and header.
+// EXPLAIN: Inside a transaction nothing is saved until the transaction is committed.
+{
+	if (transactionDepth_ != 0)
+	{
+		metadataChanged_ = true;
+		return;
+	}
+	SaveProperties();
+	SaveBAT();
+	SaveHeader();
+	metadataChanged_ = false;
+}
+
+bool CompoundFile::WriteBlock(size_t index, const char* block)
+// PURPOSE: Write a block of data to the file unless the file already holds the same data.
+// EXPLAIN: index is a Block index, which is one more than the BAT index because of the header.
+// PROMISE: Return true if data are successfully written or unchanged, false if otherwise.
+{
+	const char* present = file_.Data(index);
+	if (present && equal(block, block+file_.GetBlockSize(), present)) return true;
+	return file_.Write(index, block);
 }
 
 /*********************** Inaccessible BAT Functions ***************************/
 void CompoundFile::LoadBAT()
 // PURPOSE: Load all block allocation table information for compound file.
+// EXPLAIN: The locations of the first 109 BAT blocks are in the header. The locations of the 
+// EXPLAIN: others are in the XBAT blocks, which are chained through their last entry.
 {
-	// Read BAT indices
-	{for (size_t i=0; i<header_.BATCount_; ++i)
+	InvalidateBlockChains(true);
+	InvalidateBlockChains(false);
+	size_t entriesPerBlock = header_.bigBlockSize_ / 4;
+
+	// Collect the locations of the BAT blocks from the header and the XBAT chain
+	size_t BATCount = header_.BATCount_;
+	BATIndices_.clear();
+	XBATIndices_.clear();
+	{for (size_t i=0; i<109 && BATIndices_.size()<BATCount; ++i)
+	{
+		if (header_.BATArray_[i] >= 0) BATIndices_.push_back(header_.BATArray_[i]);
+	}}
+	int XBATIndex = header_.XBATStart_;
+	{for (size_t i=0; i<header_.XBATCount_ && XBATIndex>=0 && BATIndices_.size()<BATCount; ++i)
 	{
-		// Load blocksIndices_
-		blocksIndices_.resize(blocksIndices_.size()+128, -1);
-		file_.Read(header_.BATArray_[i]+1, &*(block_.begin()));
-		for (size_t j=0; j<128; ++j) 
+		if (!file_.Read(XBATIndex+1, &*(block_.begin()))) break;
+		XBATIndices_.push_back(XBATIndex);
+		for (size_t j=0; j+1<entriesPerBlock && BATIndices_.size()<BATCount; ++j)
 		{
-			LittleEndian::Read(&*(block_.begin()), blocksIndices_[j+i*128], j*4, 4);
+			int BATIndex;
+			LittleEndian::Read(&*(block_.begin()), BATIndex, j*4, 4);
+			if (BATIndex >= 0) BATIndices_.push_back(BATIndex);
 		}
+		LittleEndian::Read(&*(block_.begin()), XBATIndex, (entriesPerBlock-1)*4, 4);
 	}}
 
-	// Read XBAT indices
-	{for (size_t i=0; i<header_.XBATCount_; ++i)
+	// Read BAT indices
+	blocksIndices_.assign(BATIndices_.size()*entriesPerBlock, -1);
+	{for (size_t i=0; i<BATIndices_.size(); ++i)
 	{
-		blocksIndices_.resize(blocksIndices_.size()+128, -1);
-		file_.Read(header_.XBATStart_+i+1, &*(block_.begin()));
-		for (size_t j=0; j<128; ++j) 
-		{
-			LittleEndian::Read(&*(block_.begin()), blocksIndices_[j+((i+109)*128)], j*4, 4);
-		}
+		file_.Read(BATIndices_[i]+1, &*(block_.begin()));
+		LittleEndian::ReadString(&*(block_.begin()), &*(blocksIndices_.begin())+i*entriesPerBlock, 0, entriesPerBlock);
 	}}
 
 	// Read SBAT indices
-	{for (size_t i=0; i<header_.SBATCount_; ++i)
-	{
-		sblocksIndices_.resize(sblocksIndices_.size()+128, -1);
-		file_.Read(header_.SBATStart_+i+1, &*(block_.begin()));
-		for (size_t j=0; j<128; ++j)
-		{
-			LittleEndian::Read(&*(block_.begin()), sblocksIndices_[j+i*128], j*4, 4);
-		}
+	vector<size_t> SBATIndices;
+	if (header_.SBATCount_) GetBlockIndices(header_.SBATStart_, SBATIndices, true);
+	size_t SBATCount = min((size_t)header_.SBATCount_, SBATIndices.size());
+	sblocksIndices_.assign(SBATCount*entriesPerBlock, -1);
+	{for (size_t i=0; i<SBATCount; ++i)
+	{
+		file_.Read(SBATIndices[i]+1, &*(block_.begin()));
+		LittleEndian::ReadString(&*(block_.begin()), &*(sblocksIndices_.begin())+i*entriesPerBlock, 0, entriesPerBlock);
 	}}
+
+	// Build free lists
+	FindFreeBlocks(true);
+	FindFreeBlocks(false);
 }
 
 void CompoundFile::SaveBAT()
 // PURPOSE: Save all block allocation table information for compound file.
+// EXPLAIN: The header's BAT array and XBAT information are updated for SaveHeader().
+// EXPLAIN: Only blocks whose content has changed are written.
 {
+	size_t entriesPerBlock = header_.bigBlockSize_ / 4;
+
+	// Update the locations of the BAT and XBAT blocks in the header
+	header_.BATCount_ = BATIndices_.size();
+	{for (size_t i=0; i<109; ++i)
+	{
+		header_.BATArray_[i] = (i < BATIndices_.size()) ? BATIndices_[i] : -1;
+	}}
+	header_.XBATCount_ = XBATIndices_.size();
+	header_.XBATStart_ = XBATIndices_.empty() ? -2 : XBATIndices_[0];
+
 	// Write BAT indices
-	{for (size_t i=0; i<header_.BATCount_; ++i)
+	{for (size_t i=0; i<BATIndices_.size(); ++i)
 	{
-		for (size_t j=0; j<128; ++j)
-		{
-			LittleEndian::Write(&*(block_.begin()), blocksIndices_[j+i*128], j*4, 4);
-		}
-		file_.Write(header_.BATArray_[i]+1, &*(block_.begin()));
+		LittleEndian::WriteString(&*(block_.begin()), &*(blocksIndices_.begin())+i*entriesPerBlock, 0, entriesPerBlock);
+		WriteBlock(BATIndices_[i]+1, &*(block_.begin()));
 	}}
 
-	// Write XBAT indices
-	{for (size_t i=0; i<header_.XBATCount_; ++i)
+	// Write XBAT blocks, each holding the locations of BAT blocks after the first 109 
+	// followed by the location of the next XBAT block.
+	{for (size_t i=0; i<XBATIndices_.size(); ++i)
 	{
-		for (size_t j=0; j<128; ++j)
+		for (size_t j=0; j+1<entriesPerBlock; ++j)
 		{
-			LittleEndian::Write(&*(block_.begin()), blocksIndices_[j+((i+109)*128)], j*4, 4);
+			size_t BATindex = 109 + i*(entriesPerBlock-1) + j;
+			int location = (BATindex < BATIndices_.size()) ? (int)BATIndices_[BATindex] : -1;
+			LittleEndian::Write(&*(block_.begin()), location, j*4, 4);
 		}
-		file_.Write(header_.XBATStart_+i+1, &*(block_.begin()));
+		int next = (i+1 < XBATIndices_.size()) ? (int)XBATIndices_[i+1] : -2;
+		LittleEndian::Write(&*(block_.begin()), next, (entriesPerBlock-1)*4, 4);
+		WriteBlock(XBATIndices_[i]+1, &*(block_.begin()));
 	}}
 
 	// Write SBAT indices
-	{for (size_t i=0; i<header_.SBATCount_; ++i)
+	vector<size_t> SBATIndices;
+	if (header_.SBATCount_) GetBlockIndices(header_.SBATStart_, SBATIndices, true);
+	{for (size_t i=0; i<header_.SBATCount_ && i<SBATIndices.size(); ++i)
 	{
-		for (size_t j=0; j<128; ++j)
-		{
-			LittleEndian::Write(&*(block_.begin()), sblocksIndices_[j+i*128], j*4, 4);
-		}
-		file_.Write(header_.SBATStart_+i+1, &*(block_.begin()));
+		LittleEndian::WriteString(&*(block_.begin()), &*(sblocksIndices_.begin())+i*entriesPerBlock, 0, entriesPerBlock);
+		WriteBlock(SBATIndices[i]+1, &*(block_.begin()));
 	}}
 }
 
@@ -1410,60 +2165,57 @@ size_t CompoundFile::DataSize(size_t startIndex, bool isBig)
 // PROMISE: Returns the total size occupied by the property which is the total 
 // PROMISE: number of blocks occupied multiply by the block size.
 {
-	vector<size_t> indices;
-	if (isBig) 
-	{
-		GetBlockIndices(startIndex, indices, true);
-		return indices.size()*header_.bigBlockSize_;
-	}
-	else 
-	{
-		GetBlockIndices(startIndex, indices, false);
-		return indices.size()*header_.smallBlockSize_;
-	}	
+	if (isBig) return BlockChain(startIndex, true).size()*header_.bigBlockSize_;
+	else return BlockChain(startIndex, false).size()*header_.smallBlockSize_;
 }
 
-size_t CompoundFile::ReadData(size_t startIndex, char* data, bool isBig)
+size_t CompoundFile::ReadData(size_t startIndex, char* data, bool isBig, size_t size)
 // PURPOSE: Read a property's data, starting from startIndex.
-// REQUIRE: data must be large enough to receive the property's data
+// REQUIRE: data must be large enough to receive the property's data, or size bytes if size is smaller.
 // REQUIRE: The required data size can be obtained by using DataSize().
 // EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
+// EXPLAIN: At most size bytes are copied into data.
 // PROMISE: Returns the total size occupied by the property which is the total 
 // PROMISE: number of blocks occupied multiply by the block size.
 {
-	vector<size_t> indices;
 	if (isBig)
 	{
-		GetBlockIndices(startIndex, indices, true);
+		const vector<size_t>& indices = BlockChain(startIndex, true);
 		size_t maxIndices = indices.size();
-		for (size_t i=0; i<maxIndices; ++i)
+		size_t blockSize = header_.bigBlockSize_;
+		size_t maxBlocks = min(maxIndices, size/blockSize);
+		for (size_t i=0; i<maxBlocks; )
+		{
+			// Read each run of consecutive blocks at once.
+			size_t run = 1;
+			while (i+run < maxBlocks && indices[i+run] == indices[i]+run) ++run;
+			file_.Read(indices[i]+1, data+i*blockSize, run);
+			i += run;
+		}
+		if (maxBlocks < maxIndices && size%blockSize)
 		{
-			file_.Read(indices[i]+1, data+i*header_.bigBlockSize_);
+			// Copy the used part of a partially used last block.
+			vector<char> partial(blockSize);
+			file_.Read(indices[maxBlocks]+1, &*(partial.begin()));
+			copy (partial.begin(), partial.begin()+size%blockSize, data+maxBlocks*blockSize);
 		}
-		return maxIndices*header_.bigBlockSize_;
+		return maxIndices*blockSize;
 	}
 	else
 	{
-		GetBlockIndices(startIndex, indices, false);
-		size_t minIndex = *min_element(indices.begin(), indices.end());
-		size_t maxIndex = *max_element(indices.begin(), indices.end());
-		size_t smallBlocksPerBigBlock = header_.bigBlockSize_ / header_.smallBlockSize_;
-		size_t minBlock = minIndex / smallBlocksPerBigBlock;
-		size_t maxBlock = maxIndex / smallBlocksPerBigBlock + 
-						  (maxIndex % smallBlocksPerBigBlock ? 1 : 0);
-		size_t totalBlocks = maxBlock - minBlock;
-		char* buffer = new char[DataSize(properties_[0]->startBlock_, true)];
-		ReadData(properties_[0]->startBlock_, buffer, true);
-
+		const vector<char>& miniStream = MiniStream();
+		const vector<size_t>& indices = BlockChain(startIndex, false);
+		size_t blockSize = header_.smallBlockSize_;
 		size_t maxIndices = indices.size();
-		for (size_t i=0; i<maxIndices; ++i)
+		for (size_t i=0; i<maxIndices && i*blockSize<size; ++i)
 		{
-			size_t start = (indices[i] - minBlock*smallBlocksPerBigBlock)*header_.smallBlockSize_;
-			copy (buffer+start, 
-				  buffer+start+header_.smallBlockSize_, 
-				  data+i*header_.smallBlockSize_);
+			size_t start = indices[i]*blockSize;
+			size_t bytes = min(blockSize, size-i*blockSize);
+			if (start+bytes > miniStream.size()) break;
+			copy (miniStream.begin()+start, 
+				  miniStream.begin()+start+bytes, 
+				  data+i*blockSize);
 		}
-		delete[] buffer;
 		return maxIndices*header_.smallBlockSize_;
 	}
 }
@@ -1472,6 +2224,8 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 // PURPOSE: Write data to a property, starting from startIndex.
 // EXPLAIN: startIndex can be -2 if property initially has no data.
 // EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
+// EXPLAIN: Big blocks which already hold the same data are not written again, so that only 
+// EXPLAIN: the blocks which have changed are written to the file when it is flushed.
 // PROMISE: The file's original data will be replaced by the new data.
 // PROMISE: Returns the startIndex of new data for the property.
 {
@@ -1493,16 +2247,20 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 		if (extraBlocks > 0)
 		{
 			// Place new end marker
-			if (maxNewBlocks != 0) blocksIndices_[indices[maxNewBlocks]-1] = -2;
+			if (maxNewBlocks != 0) blocksIndices_[indices[maxNewBlocks-1]] = -2;
 			else startIndex = -2;
+			InvalidateBlockChains(true);
 
 			// Get indices of blocks to delete
 			vector<size_t> indicesToRemove(extraBlocks);
 			copy (indices.begin()+maxNewBlocks, indices.end(), indicesToRemove.begin());
 			indices.erase(indices.begin()+maxNewBlocks, indices.end());
 
-			// Remove extra blocks and readjust indices
-			FreeBlocks(indicesToRemove, true);
+			// Remove extra blocks and readjust indices.
+			// Blocks after the removed ones, including BAT blocks which are removed, 
+			// are moved down, so follow the moved start index to get the indices again.
+			FreeBlocks(indicesToRemove, true, &startIndex);
+			if (startIndex != -2) GetBlockIndices(startIndex, indices, true);
 		}
 
 		// Write blocks into available space
@@ -1513,7 +2271,7 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 			for (; remainingFullBlocks && curIndex<maxPresentBlocks; 
 				   --remainingFullBlocks, ++curIndex)
 			{
-				file_.Write(indices[curIndex]+1, data+curIndex*header_.bigBlockSize_);			
+				WriteBlock(indices[curIndex]+1, data+curIndex*header_.bigBlockSize_);
 			} 
 		}
 		
@@ -1530,7 +2288,7 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 				size_t newIndex = GetFreeBlockIndex(true); // Get new free block to write data
 				if (startIndex == -2) startIndex = newIndex; // Get start index
 				else LinkBlocks(index, newIndex, true); // Link last index to new index
-				file_.Write(newIndex+1, data+curIndex*header_.bigBlockSize_);
+				WriteBlock(newIndex+1, data+curIndex*header_.bigBlockSize_);
 				++curIndex;			
 				index = newIndex;
 			} while (--remainingFullBlocks);
@@ -1551,7 +2309,7 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 			// Write extra block after increasing its size to the minimum block size
 			vector<char> tempdata(header_.bigBlockSize_, 0);
 			copy (data+curIndex*header_.bigBlockSize_, data+curIndex*header_.bigBlockSize_+extraSize, tempdata.begin());
-			file_.Write(newIndex+1, &*(tempdata.begin()));			
+			WriteBlock(newIndex+1, &*(tempdata.begin()));
 		}
 		return startIndex;
 	}
@@ -1559,16 +2317,6 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 	{
 		if (size==0 && startIndex==-2) return startIndex;
 
-		if (size != 0 && properties_[0]->startBlock_ == -2)
-		{
-			size_t newIndex = GetFreeBlockIndex(true);
-			fill (block_.begin(), block_.end(), 0);
-			file_.Insert(newIndex, &*(block_.begin()));
-			IncreaseLocationReferences(vector<size_t>(1, newIndex));
-			properties_[0]->startBlock_ = newIndex;
-			properties_[0]->size_ = header_.bigBlockSize_;
-		}
-
 		// Get present indices
 		vector<size_t> indices;
 		GetBlockIndices(startIndex, indices, false);
@@ -1578,18 +2326,17 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 		size_t extraSize = size % header_.smallBlockSize_;
 		size_t maxNewBlocks = size / header_.smallBlockSize_ + (extraSize ? 1 : 0);
 
-		vector<char> smallBlocksData;
 		int extraBlocks = maxPresentBlocks - maxNewBlocks;
 		if (extraBlocks > 0)
 		{
 			// Readjust indices and remove blocks
 			// Place new end marker
-			if (maxNewBlocks != 0) sblocksIndices_[indices[maxNewBlocks]-1] = -2;
+			if (maxNewBlocks != 0) sblocksIndices_[indices[maxNewBlocks-1]] = -2;
 			else startIndex = -2;
+			InvalidateBlockChains(false);
 
 			// Get indices of blocks to delete
-			vector<size_t> indicesToRemove(extraBlocks);
-			copy (indices.begin()+maxNewBlocks, indices.end(), indicesToRemove.begin());
+			vector<size_t> indicesToRemove(indices.begin()+maxNewBlocks, indices.end());
 			indices.erase(indices.begin()+maxNewBlocks, indices.end());
 
 			// Remove extra blocks and readjust indices
@@ -1597,63 +2344,85 @@ size_t CompoundFile::WriteData(const char* data, size_t size, int startIndex, bo
 		}
 		else if (extraBlocks < 0)
 		{
-			size_t maxBlocks = properties_[0]->size_ / header_.bigBlockSize_ +
-						       (properties_[0]->size_ % header_.bigBlockSize_ ? 1 : 0);
-			size_t actualSize = maxBlocks * header_.bigBlockSize_;
-			smallBlocksData.resize(actualSize);	
-			ReadData(properties_[0]->startBlock_, &*(smallBlocksData.begin()), true);
-			smallBlocksData.resize(properties_[0]->size_);
-
 			// Readjust indices and add blocks
 			size_t newBlocksNeeded = -extraBlocks;
-			size_t index = maxPresentBlocks - 1;
+			size_t index = maxPresentBlocks ? indices.back() : 0;
 			for (size_t i=0; i<newBlocksNeeded; ++i)
 			{
 				size_t newIndex = GetFreeBlockIndex(false); // Get new free block to write data
 				if (startIndex == -2) startIndex = newIndex; // Get start index
 				else LinkBlocks(index, newIndex, false);  // Link last index to new index
-				smallBlocksData.insert(smallBlocksData.begin()+newIndex,
-									   header_.smallBlockSize_, 0);
+				indices.push_back(newIndex);
 				index = newIndex;
 			}
-			properties_[0]->size_ = newBlocksNeeded * header_.smallBlockSize_;
-		}
-		if (smallBlocksData.empty())
-		{
-			size_t maxBlocks = properties_[0]->size_ / header_.bigBlockSize_ +
-						       (properties_[0]->size_ % header_.bigBlockSize_ ? 1 : 0);
-			size_t actualSize = maxBlocks * header_.bigBlockSize_;
-			smallBlocksData.resize(actualSize);	
-			ReadData(properties_[0]->startBlock_, &*(smallBlocksData.begin()), true);
-			smallBlocksData.resize(properties_[0]->size_);
 		}
+		if (size == 0) return startIndex;
 
-		// Write blocks
-		GetBlockIndices(startIndex, indices, false);
-		size_t fullBlocks = size / header_.smallBlockSize_;
-		for (size_t i=0; i<fullBlocks; ++i)
+		// Write blocks into the cached mini stream
+		vector<char>& miniStream = MiniStream();
+		size_t maxIndex = *max_element(indices.begin(), indices.end());
+		if (miniStream.size() < (maxIndex+1)*header_.smallBlockSize_)
 		{
-			copy (data+i*header_.smallBlockSize_,
-				  data+i*header_.smallBlockSize_+header_.smallBlockSize_,
-				  smallBlocksData.begin()+indices[i]*header_.smallBlockSize_);
+			miniStream.resize((maxIndex+1)*header_.smallBlockSize_, 0);
 		}
-		if (extraSize != 0)
+		for (size_t i=0; i<maxNewBlocks; ++i)
 		{
-			copy (data+fullBlocks*header_.smallBlockSize_,
-				  data+fullBlocks*header_.smallBlockSize_+extraSize,
-				  smallBlocksData.begin()+indices[fullBlocks]*header_.smallBlockSize_);
+			size_t bytes = (i+1 < maxNewBlocks || extraSize == 0) ? header_.smallBlockSize_ : extraSize;
+			vector<char>::iterator block = miniStream.begin()+indices[i]*header_.smallBlockSize_;
+			copy (data+i*header_.smallBlockSize_, data+i*header_.smallBlockSize_+bytes, block);
+			fill (block+bytes, block+header_.smallBlockSize_, 0);
 		}
-		WriteData(&*(smallBlocksData.begin()), properties_[0]->size_,
-				 properties_[0]->startBlock_, true);
+		SaveMiniStream();
 		return startIndex;
 	}
 }
 
+vector<char>& CompoundFile::MiniStream()
+// PURPOSE: Get the mini stream holding the small blocks, which is the data of the Root Entry.
+// EXPLAIN: The mini stream is read once and cached until the compound file is closed.
+{
+	if (!miniStreamLoaded_)
+	{
+		miniStream_.clear();
+		if (!properties_.empty() && properties_[0]->startBlock_ != -2)
+		{
+			miniStream_.resize(DataSize(properties_[0]->startBlock_, true));
+			ReadData(properties_[0]->startBlock_, &*(miniStream_.begin()), true);
+			int size = properties_[0]->size_;
+			if (size >= 0 && miniStream_.size() > (size_t)size) miniStream_.resize(size);
+		}
+		miniStreamLoaded_ = true;
+	}
+	return miniStream_;
+}
+
+void CompoundFile::SaveMiniStream()
+// PURPOSE: Write the cached mini stream to the big blocks of the Root Entry.
+{
+	properties_[0]->startBlock_ = WriteData(&*(miniStream_.begin()), miniStream_.size(), 
+											properties_[0]->startBlock_, true);
+	properties_[0]->size_ = miniStream_.size();
+}
+
 void CompoundFile::GetBlockIndices(size_t startIndex, vector<size_t>& indices, bool isBig)
 // PURPOSE: Get the indices of blocks where data are stored, starting from startIndex.
 // EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
 {
-	indices.clear();
+	indices = BlockChain(startIndex, isBig);
+}
+
+const vector<size_t>& CompoundFile::BlockChain(size_t startIndex, bool isBig)
+// PURPOSE: Get the cached indices of blocks where data are stored, starting from startIndex.
+// EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
+// EXPLAIN: A chain is followed through the BAT or SBAT indices only once and cached 
+// EXPLAIN: until the indices are changed.
+// PROMISE: The returned indices stay valid until InvalidateBlockChains() is called.
+{
+	map<size_t, vector<size_t> >& chains = isBig ? blocksChains_ : sblocksChains_;
+	map<size_t, vector<size_t> >::iterator chain = chains.find(startIndex);
+	if (chain != chains.end()) return chain->second;
+
+	vector<size_t>& indices = chains[startIndex];
 	if (isBig)
 	{
 		for (size_t i=startIndex; i!=-2; i=blocksIndices_[i]) indices.push_back(i);
@@ -1662,6 +2431,15 @@ void CompoundFile::GetBlockIndices(size_t startIndex, vector<size_t>& indices, b
 	{
 		for (size_t i=startIndex; i!=-2; i=sblocksIndices_[i]) indices.push_back(i);
 	}
+	return indices;
+}
+
+void CompoundFile::InvalidateBlockChains(bool isBig)
+// PURPOSE: Discard the cached block chains after BAT or SBAT indices are changed.
+// EXPLAIN: isBig is true if BAT indices are changed, false if SBAT indices are changed.
+{
+	if (isBig) blocksChains_.clear();
+	else sblocksChains_.clear();
 }
 
 size_t CompoundFile::GetFreeBlockIndex(bool isBig)
@@ -1671,37 +2449,14 @@ size_t CompoundFile::GetFreeBlockIndex(bool isBig)
 // PROMISE: It only adjust BAT arrays and indices or SBAT arrays and indices so that
 // PROMISE: it gives the index of a new block where data can be inserted.
 {
-	size_t index;
-	if (isBig)
-	{
-		// Find first free location
-		index = distance(blocksIndices_.begin(), 
-						 find(blocksIndices_.begin(), 
-							  blocksIndices_.end(), -1));
-		if (index == blocksIndices_.size())
-		{
-			ExpandBATArray(true);
-			index = distance(blocksIndices_.begin(), 
- 							 find(blocksIndices_.begin(), 
-								  blocksIndices_.end(), -1));
-		}
-		blocksIndices_[index] = -2;
-	}
-	else
-	{
-		// Find first free location
-		index = distance(sblocksIndices_.begin(), 
-						 find(sblocksIndices_.begin(), 
-							  sblocksIndices_.end(), -1));
-		if (index == sblocksIndices_.size())
-		{
-			ExpandBATArray(false);
-			index = distance(sblocksIndices_.begin(), 
-							 find(sblocksIndices_.begin(), 
-							 	  sblocksIndices_.end(), -1));
-		}
-		sblocksIndices_[index] = -2;
-	}
+	vector<int>& blocksIndices = isBig ? blocksIndices_ : sblocksIndices_;
+	vector<size_t>& freeIndices = isBig ? freeBlocksIndices_ : freeSBlocksIndices_;
+	
+	// Take the first free location from the free list
+	if (freeIndices.empty()) ExpandBATArray(isBig);
+	size_t index = freeIndices.back();
+	freeIndices.pop_back();
+	blocksIndices[index] = -2;
 	return index;
 }
 
@@ -1711,64 +2466,44 @@ void CompoundFile::ExpandBATArray(bool isBig)
 {
 	size_t newIndex;
 	fill (block_.begin(), block_.end(), -1);
+	size_t oldSize = isBig ? blocksIndices_.size() : sblocksIndices_.size();
+	size_t entriesPerBlock = header_.bigBlockSize_ / 4;
 
 	if (isBig)
 	{
-		size_t BATindex = distance(&header_.BATArray_[0], 
-								   find(header_.BATArray_, 
-										header_.BATArray_+109, -1));
-		if (BATindex < 109)
-		{
-			// Set new BAT index location
-			newIndex = blocksIndices_.size(); // New index location
-			file_.Insert(newIndex+1, &*(block_.begin()));
-			IncreaseLocationReferences(vector<size_t>(1, newIndex));
-
-			// Update BAT array
-			header_.BATArray_[BATindex] = newIndex;
-			++header_.BATCount_;
-		}
-		else
+		// Append a new BAT block after all used blocks so that no block is moved.
+		// This is possible because the BAT is only expanded when it has no free entries.
+		newIndex = blocksIndices_.size();
+		file_.Write(newIndex+1, &*(block_.begin()));
+		BATIndices_.push_back(newIndex);
+		blocksIndices_.resize(blocksIndices_.size()+entriesPerBlock, -1);
+		blocksIndices_[newIndex] = -3;
+
+		// Append a new XBAT block if the header and XBAT blocks cannot hold its location.
+		if (BATIndices_.size() > 109 + XBATIndices_.size()*(entriesPerBlock-1))
 		{
-			// No free BAT indices. Increment using XBAT
-			// Set new XBAT index location
-			if (header_.XBATCount_ != 0)
-			{
-				newIndex = header_.XBATStart_ + header_.XBATCount_;
-				file_.Insert(newIndex, &*(block_.begin()));
-				IncreaseLocationReferences(vector<size_t>(1, newIndex));
-			}
-			else
-			{
-				newIndex = blocksIndices_.size();
-				file_.Insert(newIndex, &*(block_.begin()));
-				IncreaseLocationReferences(vector<size_t>(1, newIndex));
-				header_.XBATStart_ = newIndex;
-			}
-			++header_.XBATCount_;
+			file_.Write(newIndex+2, &*(block_.begin()));
+			XBATIndices_.push_back(newIndex+1);
+			blocksIndices_[newIndex+1] = -4;
 		}
-		blocksIndices_.insert(blocksIndices_.begin()+newIndex, -3);
-		blocksIndices_.resize(blocksIndices_.size()+127, -1);
 	}
 	else
 	{
-		// Set new SBAT index location
+		// Set new SBAT index location and link it to the end of the SBAT chain
+		newIndex = GetFreeBlockIndex(true);
+		fill (block_.begin(), block_.end(), -1);
+		file_.Write(newIndex+1, &*(block_.begin()));
 		if (header_.SBATCount_ != 0)
 		{
-			newIndex = header_.SBATStart_ + header_.SBATCount_;
-			file_.Insert(newIndex, &*(block_.begin()));
-			IncreaseLocationReferences(vector<size_t>(1, newIndex));
-		}
-		else
-		{
-			newIndex = GetFreeBlockIndex(true);
-			file_.Insert(newIndex, &*(block_.begin()));
-			IncreaseLocationReferences(vector<size_t>(1, newIndex));
-			header_.SBATStart_ = newIndex;
+			vector<size_t> SBATIndices;
+			GetBlockIndices(header_.SBATStart_, SBATIndices, true);
+			LinkBlocks(SBATIndices.back(), newIndex, true);
 		}
+		else header_.SBATStart_ = newIndex;
 		++header_.SBATCount_;
-		sblocksIndices_.resize(sblocksIndices_.size()+128, -1);
+		sblocksIndices_.resize(sblocksIndices_.size()+entriesPerBlock, -1);
 	}
+	FindFreeBlocks(isBig, oldSize);
 }
 
 void CompoundFile::LinkBlocks(size_t from, size_t to, bool isBig)
@@ -1777,111 +2512,107 @@ void CompoundFile::LinkBlocks(size_t from, size_t to, bool isBig)
 {
 	if (isBig) blocksIndices_[from] = to;	
 	else sblocksIndices_[from] = to;
+	InvalidateBlockChains(isBig);
+}
+
+int CompoundFile::LinkRun(size_t& index, size_t count, bool isBig)
+// PURPOSE: Link count consecutive BAT or SBAT indices starting from index into a chain.
+// EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
+// PROMISE: index is advanced past the chain. Returns the start of the chain, or -2 if count is 0.
+{
+	if (count == 0) return -2;
+	vector<int>& blocksIndices = isBig ? blocksIndices_ : sblocksIndices_;
+	int start = index;
+	{for (size_t i=1; i<count; ++i, ++index) blocksIndices[index] = index+1;}
+	blocksIndices[index++] = -2;
+	InvalidateBlockChains(isBig);
+	return start;
 }
 
-void CompoundFile::FreeBlocks(vector<size_t>& indices, bool isBig)
+void CompoundFile::FreeBlocks(vector<size_t>& indices, bool isBig, int* reference)
 // PURPOSE: Delete blocks of data from compound file.
 // EXPLAIN: indices contains indices to blocks of data to be deleted. 
 // EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
+// EXPLAIN: reference, if given, is a big block index held by the caller. It is decreased 
+// EXPLAIN: like every other block location reference when blocks are erased from the file.
 {
-	if (isBig)
+	InvalidateBlockChains(isBig);
+	if (isBig && allocationPolicy_ == APPEND_ONLY)
+	{
+		// Only mark blocks as free so that no other block is moved. 
+		// They are reused by later writes.
+		size_t maxIndices = indices.size();
+		{for (size_t i=0; i<maxIndices; ++i) blocksIndices_[indices[i]] = -1;}
+		size_t maxFreeIndices = freeBlocksIndices_.size();
+		freeBlocksIndices_.insert(freeBlocksIndices_.end(), indices.begin(), indices.end());
+		sort (freeBlocksIndices_.begin()+maxFreeIndices, freeBlocksIndices_.end(), greater<size_t>());
+		inplace_merge (freeBlocksIndices_.begin(), freeBlocksIndices_.begin()+maxFreeIndices, 
+					   freeBlocksIndices_.end(), greater<size_t>());
+	}
+	else if (isBig)
 	{
 		// Decrease all location references before deleting blocks from file.
-		DecreaseLocationReferences(indices);
+		DecreaseLocationReferences(indices, reference);
 		size_t maxIndices = indices.size();
 		{for (size_t i=0; i<maxIndices; ++i) ++indices[i];}	// Increase by 1 because Block index 1 corresponds to index 0 here
 		file_.Erase(indices);
 
-		// Shrink BAT indices if necessary
-		vector<size_t> indicesToRemove;
-		while (distance(find(blocksIndices_.begin(), 
-						     blocksIndices_.end(),-1),
-						     blocksIndices_.end()) >= 128)
-		{			
-			blocksIndices_.resize(blocksIndices_.size()-128);
-			if (header_.XBATCount_ != 0)
-			{
-				// Shrink XBAT first
-				--header_.XBATCount_;
-				indicesToRemove.push_back(header_.XBATStart_+header_.XBATCount_+1); // Add 1 because Block index 1 corresponds to index 0 here
-				if (header_.XBATCount_ == 0) header_.XBATStart_ = -2;
-			}
-			else
+		// Shrink BAT indices if necessary.
+		// The BAT has no free entries before the used ones, so whole BAT blocks at its end can be freed.
+		size_t entriesPerBlock = header_.bigBlockSize_ / 4;
+		while (BATIndices_.size() > 1 && 
+			   distance(find(blocksIndices_.begin(), blocksIndices_.end(), -1), 
+						blocksIndices_.end()) >= (ptrdiff_t)entriesPerBlock)
+		{
+			// Remove the last BAT block, and the last XBAT block if it is no longer needed.
+			vector<size_t> indicesToRemove(1, BATIndices_.back());
+			BATIndices_.pop_back();
+			if (!XBATIndices_.empty() && 
+				BATIndices_.size() <= 109 + (XBATIndices_.size()-1)*(entriesPerBlock-1))
 			{
-				// No XBAT, delete last occupied BAT array element
-				size_t BATindex = distance(&header_.BATArray_[0], 
-										   find(header_.BATArray_, 
-												header_.BATArray_+109, -1));
-				if (BATindex != 109)
-				{
-					--header_.BATCount_;
-					indicesToRemove.push_back(header_.BATArray_[BATindex-1]+1); // Add 1 because Block index 1 corresponds to index 0 here
-					header_.BATArray_[BATindex-1] = -1;
-				}
+				indicesToRemove.push_back(XBATIndices_.back());
+				XBATIndices_.pop_back();
 			}
+			DecreaseLocationReferences(indicesToRemove, reference);
+			{for (size_t i=0; i<indicesToRemove.size(); ++i) ++indicesToRemove[i];}	// Increase by 1 because Block index 1 corresponds to index 0 here
+			file_.Erase(indicesToRemove);
+			blocksIndices_.resize(blocksIndices_.size()-entriesPerBlock);
+
+			// Remove the free indices of the removed entries from the front of the free list
+			freeBlocksIndices_.erase(freeBlocksIndices_.begin(), 
+									 upper_bound(freeBlocksIndices_.begin(), freeBlocksIndices_.end(), 
+												 blocksIndices_.size(), greater<size_t>()));
 		}
-		// Erase extra BAT indices if present
-		if (!indicesToRemove.empty()) file_.Erase(indicesToRemove);
 	}
 	else
 	{
-		// Erase block
+		// Mark blocks as free. Their space in the mini stream is reused by later writes.
 		size_t maxIndices = indices.size();
-		size_t maxBlocks = properties_[0]->size_ / header_.bigBlockSize_ +
-						   (properties_[0]->size_ % header_.bigBlockSize_ ? 1 : 0);
-		size_t size = maxBlocks * header_.bigBlockSize_;
-		char* data = new char[size];
-		ReadData(properties_[0]->startBlock_, data, true);
-		size_t maxSmallBlocks = properties_[0]->size_ / header_.smallBlockSize_;
-		char* newdata = new char[properties_[0]->size_-maxIndices*header_.smallBlockSize_];
-		{for (size_t i=0, j=0; i<maxSmallBlocks; ++i)
-		{
-			if (find(indices.begin(), indices.end(), i) == indices.end()) 
-			{
-				copy (data+i*header_.smallBlockSize_, 
-					  data+i*header_.smallBlockSize_+header_.smallBlockSize_, 
-					  newdata+j*header_.smallBlockSize_);
-				++j;
-			}
-		}}
-		properties_[0]->startBlock_ = WriteData(newdata, properties_[0]->size_-maxIndices*header_.smallBlockSize_,
-											   properties_[0]->startBlock_, true);
-		properties_[0]->size_ -= maxIndices*header_.smallBlockSize_;
-		delete[] data;
-		delete[] newdata;
-
-		// Change SBAT indices
-		size_t maxSBATindices = sblocksIndices_.size();
-		{for (size_t i=0; i<maxIndices; ++i)
-		{
-			for (size_t j=0; j<maxSBATindices; ++j)
-			{
-				if (j == indices[i]) continue;
-				if (sblocksIndices_[j] == indices[i]) sblocksIndices_[j] = sblocksIndices_[indices[i]];
-				if (sblocksIndices_[j] > indices[i] &&
-					sblocksIndices_[j] != -1 &&
-					sblocksIndices_[j] != -2) --sblocksIndices_[j];
-			}
-		}}
-		sort (indices.begin(), indices.end(), greater<size_t>());
-		{for (size_t i=0; i<maxIndices; ++i)
-		{
-			sblocksIndices_.erase(sblocksIndices_.begin()+indices[i]);
-			sblocksIndices_.push_back(-1);
-		}}
-		vector<size_t> indicesToRemove;
-		while (distance(find(sblocksIndices_.begin(), 
-						     sblocksIndices_.end(),-1),
-						     sblocksIndices_.end()) >= 128)
-		{
-			// Shrink SBAT indices if necessary
-			sblocksIndices_.resize(sblocksIndices_.size()-128);
-			--header_.SBATCount_;
-			indicesToRemove.push_back(header_.SBATStart_+header_.SBATCount_);
-			if (header_.SBATCount_ == 0) header_.SBATStart_ = -2;
-		}
-		FreeBlocks(indicesToRemove, true);
+		{for (size_t i=0; i<maxIndices; ++i) sblocksIndices_[indices[i]] = -1;}
+		size_t maxFreeIndices = freeSBlocksIndices_.size();
+		freeSBlocksIndices_.insert(freeSBlocksIndices_.end(), indices.begin(), indices.end());
+		sort (freeSBlocksIndices_.begin()+maxFreeIndices, freeSBlocksIndices_.end(), greater<size_t>());
+		inplace_merge (freeSBlocksIndices_.begin(), freeSBlocksIndices_.begin()+maxFreeIndices, 
+					   freeSBlocksIndices_.end(), greater<size_t>());
+	}
+}
+
+void CompoundFile::FindFreeBlocks(bool isBig, size_t from)
+// PURPOSE: Add the free BAT or SBAT indices from index from onwards to the free list.
+// EXPLAIN: isBig is true if property uses big blocks, false if it uses small blocks.
+// EXPLAIN: The free list is rebuilt from scratch if from is 0.
+// PROMISE: The free list is sorted in descending order so that the lowest free index is at its back.
+{
+	vector<int>& blocksIndices = isBig ? blocksIndices_ : sblocksIndices_;
+	vector<size_t>& freeIndices = isBig ? freeBlocksIndices_ : freeSBlocksIndices_;
+	if (from == 0) freeIndices.clear();
+
+	vector<size_t> newFreeIndices;
+	for (size_t i=blocksIndices.size(); i>from; --i)
+	{
+		if (blocksIndices[i-1] == -1) newFreeIndices.push_back(i-1);
 	}
+	freeIndices.insert(freeIndices.begin(), newFreeIndices.begin(), newFreeIndices.end());
 }
 
 /*********************** Inaccessible Properties Functions ***************************/
@@ -1902,11 +2633,11 @@ void CompoundFile::LoadProperties()
 
 	for (size_t i=0; i<maxBlocks; ++i)
 	{
-		for (size_t j=0; j<4; ++j)
+		for (size_t j=0; j<propertiesPerBlock; ++j)
 		{
 			// Read individual property
 			Property* property = new Property;
-			property->Read(buffer+i*512+j*128);
+			property->Read(buffer+i*header_.bigBlockSize_+j*128);
 			if (wcslen(property->name_) == 0)
 			{
 				delete property;
@@ -1936,17 +2667,24 @@ void CompoundFile::SaveProperties()
 	size_t maxBlocks = maxProperties / propertiesPerBlock + 
 					   (maxProperties % propertiesPerBlock ? 1 : 0);
 	size_t propertiesSize = maxBlocks*header_.bigBlockSize_;
-	char* buffer = new char[propertiesSize];
-	{for (size_t i=0; i<propertiesSize; ++i) buffer[i] = 0;}
-	{for (size_t i=0; i<maxProperties; ++i)
-	{
-		// Save individual property
-		properties_[i]->Write(buffer+i*128);
-	}}
+	if (header_.uk6_ >= 4) header_.uk9_ = maxBlocks;	// Version 4 files record the number of property blocks
 
 	// Write properties' data to compound file.
-	WriteData(buffer, propertiesSize, header_.propertiesStart_, true);
-	delete[] buffer;
+	// Freeing blocks of a shrinking property table moves the blocks after them, which changes 
+	// the start blocks of other properties. So the properties are written until they are unchanged.
+	vector<char> buffer(propertiesSize, 0);
+	vector<char> written;
+	for (;;)
+	{
+		{for (size_t i=0; i<maxProperties; ++i)
+		{
+			// Save individual property
+			properties_[i]->Write(&*(buffer.begin())+i*128);
+		}}
+		if (buffer == written) break;
+		WriteData(&*(buffer.begin()), propertiesSize, header_.propertiesStart_, true);
+		written = buffer;
+	}
 }
 
 int CompoundFile::MakeProperty(const wchar_t* path, CompoundFile::Property* property)
@@ -2101,17 +2839,7 @@ CompoundFile::FindProperty(CompoundFile::PropertyTree* parentTree,
 // PROMISE: Returns a pointer to the property tree of the property if property
 // PROMISE: is present, 0 if otherwise.
 {
-	if (parentTree->self_->childProp_ != -1)
-	{
-		size_t maxChildren = parentTree->children_.size();
-		for (size_t i=0; i<maxChildren; ++i)
-		{
-			if (wcscmp(parentTree->children_[i]->self_->name_, name) == 0)
-			{
-				return parentTree->children_[i];
-			}
-		}
-	}
+	if (parentTree->self_->childProp_ != -1) return parentTree->FindChild(name);
 	return 0;
 }
 
@@ -2165,6 +2893,7 @@ void CompoundFile::InsertPropertyTree(CompoundFile::PropertyTree* parentTree,
 		if (index < parentTree->children_[i]->index_) break;
 	}
 	parentTree->children_.insert(parentTree->children_.begin()+i, tree);
+	parentTree->IndexChild(tree);
 
 	// Update children indices
 	UpdateChildrenIndices(parentTree);
@@ -2176,6 +2905,9 @@ void CompoundFile::DeletePropertyTree(CompoundFile::PropertyTree* tree)
 // PROMISE: The tree's parent's child property and all the its children previous property 
 // PROMISE: and next property will be readjusted to accomodate the deleted property.
 {
+	// Remove property from the parent's name index while its name is still available
+	tree->parent_->UnindexChild(tree);
+
 	// Decrease all property references
 	DecreasePropertyReferences(propertyTrees_, tree->index_);
 
@@ -2321,32 +3053,51 @@ namespace YExcel
 {
 using namespace YCompoundFiles;
 /************************************************************************************************************/
-Record::Record() : dataSize_(0), recordSize_(4) {};
+Record::Record() : view_(0), dataSize_(0), recordSize_(4) {};
 Record::~Record() {};
 size_t Record::Read(const char* data)
 {
 	LittleEndian::Read(data, code_, 0, 2);		// Read operation code.
 	LittleEndian::Read(data, dataSize_, 2, 2);	// Read size of record.
-	data_.assign(data+4, data+4+dataSize_);
-
 	recordSize_ = 4 + dataSize_;
 
 	// Check if next record is a continue record
 	continueIndices_.clear();
 	short code;
 	LittleEndian::Read(data, code, dataSize_+4, 2);
+	if (code != CODE::CONTINUE)
+	{
+		// Refer to the record data in data instead of copying it.
+		data_.clear();
+		view_ = data+4;
+		return recordSize_;
+	}
+
+	// Measure the continue records first so that the joined data is allocated only once.
+	size_t firstRecordSize = recordSize_;
 	while (code == CODE::CONTINUE)
 	{
 		continueIndices_.push_back(dataSize_);
 
 		size_t size;
 		LittleEndian::Read(data, size, recordSize_+2, 2);
-		data_.insert(data_.end(), data+recordSize_+4, data+recordSize_+4+size);
 		dataSize_ += size;
 		recordSize_ += 4 + size;
 
 		LittleEndian::Read(data, code, recordSize_, 2);
 	};
+
+	// Join the record data with the data of its continue records.
+	view_ = 0;
+	data_.resize(dataSize_);
+	copy (data+4, data+firstRecordSize, data_.begin());
+	size_t maxContinue = continueIndices_.size();
+	for (size_t c=0, npos=firstRecordSize; c<maxContinue; ++c)
+	{
+		size_t size = ((c+1 < maxContinue) ? continueIndices_[c+1] : dataSize_) - continueIndices_[c];
+		copy (data+npos+4, data+npos+4+size, data_.begin()+continueIndices_[c]);
+		npos += 4 + size;
+	}
 	return recordSize_;
 }
 size_t Record::Write(char* data)
@@ -2356,6 +3107,7 @@ size_t Record::Write(char* data)
 
 	if (continueIndices_.empty())
 	{
+		const char* body = Data();
 		size_t size = dataSize_;
 		size_t i=0;
 		while (size > 8224)
@@ -2363,7 +3115,7 @@ size_t Record::Write(char* data)
 			LittleEndian::Write(data, 8224, npos, 2);	// Write size of record.
 			npos += 2;
 			size -= 8224;
-			copy (data_.begin()+i*8224, data_.begin()+(i+1)*8224, data+npos);
+			copy (body+i*8224, body+(i+1)*8224, data+npos);
 			npos += 8224;
 
 			if (size != 0) 
@@ -2376,7 +3128,7 @@ size_t Record::Write(char* data)
 
 		LittleEndian::Write(data, size, npos, 2);	// Write size of record.
 		npos += 2;
-		copy (data_.begin()+i*8224, data_.begin()+i*8224+size, data+npos);
+		copy (body+i*8224, body+i*8224+size, data+npos);
 		npos += size;
 	}
 	else
@@ -2414,6 +3166,12 @@ size_t Record::Write(char* data)
 }
 size_t Record::DataSize() {return dataSize_;}
 size_t Record::RecordSize() {return recordSize_;}
+const char* Record::Data() const
+// PURPOSE: Get the record data, which is read in place from the buffer given to Read() 
+// PURPOSE: until the record is written or has continue records.
+{
+	return data_.empty() ? view_ : &*(data_.begin());
+}
 
 /************************************************************************************************************/
 
@@ -2422,12 +3180,12 @@ BOF::BOF() : Record() {code_ = CODE::BOF; dataSize_ = 16; recordSize_ = 20;}
 size_t BOF::Read(const char* data)
 {
 	Record::Read(data);	
-	LittleEndian::Read(data_, version_, 0, 2);
-	LittleEndian::Read(data_, type_, 2, 2);
-	LittleEndian::Read(data_, buildIdentifier_, 4, 2);
-	LittleEndian::Read(data_, buildYear_, 6, 2);
-	LittleEndian::Read(data_, fileHistoryFlags_, 8, 4);
-	LittleEndian::Read(data_, lowestExcelVersion_, 12, 4);
+	LittleEndian::Read(Data(), version_, 0, 2);
+	LittleEndian::Read(Data(), type_, 2, 2);
+	LittleEndian::Read(Data(), buildIdentifier_, 4, 2);
+	LittleEndian::Read(Data(), buildYear_, 6, 2);
+	LittleEndian::Read(Data(), fileHistoryFlags_, 8, 4);
+	LittleEndian::Read(Data(), lowestExcelVersion_, 12, 4);
 	return RecordSize();
 }
 size_t BOF::Write(char* data)
@@ -2669,10 +3427,8 @@ size_t LargeString::ContinueRead(const char* data, size_t size)
 		}
 		else
 		{
-			// String to be read is in ANSI
-			vector<char> name(size);
-			LittleEndian::ReadString(data, &*(name.begin()), npos, size);
-			mbstowcs(&*(wname_.begin())+strpos, &*(name.begin()), size);
+			// String to be read is compressed Latin-1
+			LittleEndian::Widen(data+npos, &*(wname_.begin())+strpos, size);
 			npos += size;
 		}
 		if (richtext_) npos += 4*richtext_;
@@ -2687,17 +3443,30 @@ size_t LargeString::ContinueRead(const char* data, size_t size)
 		if (phonetic_) npos += 4;
 
 		size_t strpos = name_.size();
-		name_.resize(strpos+size, 0);
 		if (unicode & 1)
 		{
 			// String to be read is in unicode
 			vector<wchar_t> name(size);
 			LittleEndian::ReadString(data, &*(name.begin()), npos, size);
-			wcstombs(&*(name_.begin())+strpos, &*(name.begin()), size);
+			if (LittleEndian::FitsLatin1(&*(name.begin()), size))
+			{
+				name_.resize(strpos+size, 0);
+				LittleEndian::Narrow(&*(name.begin()), &*(name_.begin())+strpos, size);
+			}
+			else
+			{
+				// Characters would be lost, so store the whole string uncompressed instead.
+				wname_.resize(strpos);
+				if (strpos) LittleEndian::Widen(&*(name_.begin()), &*(wname_.begin()), strpos);
+				wname_.insert(wname_.end(), name.begin(), name.end());
+				name_.clear();
+				unicode_ |= 1;
+			}
 			npos += size * SIZEOFWCHAR_T;
 		}
 		else
 		{
+			name_.resize(strpos+size, 0);
 			LittleEndian::ReadString(data, &*(name_.begin())+strpos, npos, size);
 			npos += size;
 		}
@@ -2765,6 +3534,160 @@ size_t LargeString::StringSize()
 }
 /************************************************************************************************************/
 
+/************************************************************************************************************/
+StringPool::StringPool() : hashed_(0) {};
+
+void StringPool::Clear()
+{
+	arena_.clear();
+	entries_.clear();
+	slots_.clear();
+	hashed_ = 0;
+}
+
+void StringPool::Swap(StringPool& pool)
+{
+	arena_.swap(pool.arena_);
+	entries_.swap(pool.entries_);
+	slots_.swap(pool.slots_);
+	swap(hashed_, pool.hashed_);
+}
+
+void StringPool::Reserve(size_t strings, size_t bytes)
+{
+	entries_.reserve(strings);
+	arena_.reserve(bytes);
+}
+
+size_t StringPool::Add(const char* str, size_t length)
+{
+	return Add(str, length, length, false);
+}
+
+size_t StringPool::Add(const wchar_t* str, size_t length)
+{
+	return Add(reinterpret_cast<const char*>(str), length*sizeof(wchar_t), length, true);
+}
+
+char* StringPool::AppendString(size_t length)
+{
+	return Append(length, false);
+}
+
+wchar_t* StringPool::AppendWString(size_t length)
+{
+	return reinterpret_cast<wchar_t*>(Append(length, true));
+}
+
+size_t StringPool::Hash(const char* data, size_t bytes, bool unicode)
+// PURPOSE: Return FNV-1a hash of the bytes and the encoding of a string.
+{
+	size_t hash = 2166136261U;
+	for (size_t i=0; i<bytes; ++i) hash = (hash ^ (unsigned char)data[i]) * 16777619U;
+	return (hash ^ (unicode ? 1 : 0)) * 16777619U;
+}
+
+size_t StringPool::Add(const char* data, size_t bytes, size_t length, bool unicode)
+// PURPOSE: Return index of the string of given bytes, adding it if not present.
+// EXPLAIN: ANSI and Unicode strings with the same characters are different strings.
+{
+	size_t hash = Hash(data, bytes, unicode);
+	if (hashed_ < entries_.size() || 2*(entries_.size()+1) > slots_.size())
+	{
+		size_t capacity = 1024;
+		while (capacity < 2*(entries_.size()+1)) capacity *= 2;
+		Rehash(capacity);
+	}
+	size_t mask = slots_.size() - 1;
+	size_t slot = hash & mask;
+	for (; slots_[slot]; slot=(slot+1)&mask)
+	{
+		const Entry& entry = entries_[slots_[slot]-1];
+		if (entry.hash_ == hash && entry.length_ == length && entry.unicode_ == unicode &&
+			(bytes == 0 || memcmp(&*(arena_.begin())+entry.offset_, data, bytes) == 0)) return slots_[slot]-1;
+	}
+
+	// New string.
+	char* str = Append(length, unicode);
+	if (bytes) memcpy(str, data, bytes);
+	entries_.back().hash_ = hash;
+	slots_[slot] = entries_.size();
+	hashed_ = entries_.size();
+	return entries_.size() - 1;
+}
+
+char* StringPool::Append(size_t length, bool unicode)
+// PURPOSE: Add a new string of length characters to the arena and return where to store its characters.
+// EXPLAIN: Unicode strings are aligned for wchar_t. The null character after the string is already stored.
+// PROMISE: Returned pointer is valid until the next string is added.
+{
+	size_t charSize = unicode ? sizeof(wchar_t) : 1;
+	size_t offset = (arena_.size() + charSize-1) / charSize * charSize;
+	arena_.resize(offset + (length+1)*charSize, 0);
+
+	Entry entry;
+	entry.offset_ = offset;
+	entry.length_ = length;
+	entry.hash_ = 0;
+	entry.unicode_ = unicode;
+	entries_.push_back(entry);
+	return &*(arena_.begin()) + offset;
+}
+
+void StringPool::Rehash(size_t capacity)
+// PURPOSE: Resize hash table to capacity slots and insert every entry, hashing those which were appended.
+// REQUIRE: capacity is a power of two and greater than the number of entries.
+{
+	for (size_t i=hashed_; i<entries_.size(); ++i)
+	{
+		Entry& entry = entries_[i];
+		size_t charSize = entry.unicode_ ? sizeof(wchar_t) : 1;
+		entry.hash_ = Hash(&*(arena_.begin())+entry.offset_, entry.length_*charSize, entry.unicode_);
+	}
+	hashed_ = entries_.size();
+
+	slots_.assign(capacity, 0);
+	size_t mask = capacity - 1;
+	for (size_t i=0; i<entries_.size(); ++i)
+	{
+		size_t slot = entries_[i].hash_ & mask;
+		while (slots_[slot]) slot = (slot+1) & mask;
+		slots_[slot] = i + 1;
+	}
+}
+
+size_t StringPool::Size() const {return entries_.size();}
+bool StringPool::IsUnicode(size_t index) const {return entries_[index].unicode_;}
+size_t StringPool::Length(size_t index) const {return entries_[index].length_;}
+
+const char* StringPool::String(size_t index) const
+{
+	if (entries_[index].unicode_) return 0;
+	return &*(arena_.begin()) + entries_[index].offset_;
+}
+
+const wchar_t* StringPool::WString(size_t index) const
+{
+	if (!entries_[index].unicode_) return 0;
+	return reinterpret_cast<const wchar_t*>(&*(arena_.begin()) + entries_[index].offset_);
+}
+/************************************************************************************************************/
+
+/************************************************************************************************************/
+SharedStrings::SharedStrings() : references_(1) {};
+SharedStrings::~SharedStrings() {};
+
+void SharedStrings::Acquire()
+{
+	++references_;
+}
+
+void SharedStrings::Release()
+{
+	if (--references_ == 0) delete this;
+}
+/************************************************************************************************************/
+
 
 /************************************************************************************************************/
 Workbook::Workbook()
@@ -2892,15 +3815,15 @@ Workbook::Window1::Window1() : Record(),
 size_t Workbook::Window1::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, horizontalPos_, 0, 2);
-	LittleEndian::Read(data_, verticalPos_, 2, 2);
-	LittleEndian::Read(data_, width_, 4, 2);
-	LittleEndian::Read(data_, height_, 6, 2);
-	LittleEndian::Read(data_, options_, 8, 2);
-	LittleEndian::Read(data_, activeWorksheetIndex_, 10, 2);
-	LittleEndian::Read(data_, firstVisibleTabIndex_, 12, 2);
-	LittleEndian::Read(data_, selectedWorksheetNo_, 14, 2);
-	LittleEndian::Read(data_, worksheetTabBarWidth_, 16, 2);
+	LittleEndian::Read(Data(), horizontalPos_, 0, 2);
+	LittleEndian::Read(Data(), verticalPos_, 2, 2);
+	LittleEndian::Read(Data(), width_, 4, 2);
+	LittleEndian::Read(Data(), height_, 6, 2);
+	LittleEndian::Read(Data(), options_, 8, 2);
+	LittleEndian::Read(Data(), activeWorksheetIndex_, 10, 2);
+	LittleEndian::Read(Data(), firstVisibleTabIndex_, 12, 2);
+	LittleEndian::Read(Data(), selectedWorksheetNo_, 14, 2);
+	LittleEndian::Read(Data(), worksheetTabBarWidth_, 16, 2);
 	return RecordSize();
 }
 size_t Workbook::Window1::Write(char* data)
@@ -2933,16 +3856,16 @@ Workbook::Font::Font() : Record(),
 size_t Workbook::Font::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, height_, 0, 2);
-	LittleEndian::Read(data_, options_, 2, 2);
-	LittleEndian::Read(data_, colourIndex_, 4, 2);
-	LittleEndian::Read(data_, weight_, 6, 2);
-	LittleEndian::Read(data_, escapementType_, 8, 2);
-	LittleEndian::Read(data_, underlineType_, 10, 1);
-	LittleEndian::Read(data_, family_, 11, 1);
-	LittleEndian::Read(data_, characterSet_, 12, 1);
-	LittleEndian::Read(data_, unused_, 13, 1);
-	name_.Read(&*(data_.begin())+14);
+	LittleEndian::Read(Data(), height_, 0, 2);
+	LittleEndian::Read(Data(), options_, 2, 2);
+	LittleEndian::Read(Data(), colourIndex_, 4, 2);
+	LittleEndian::Read(Data(), weight_, 6, 2);
+	LittleEndian::Read(Data(), escapementType_, 8, 2);
+	LittleEndian::Read(Data(), underlineType_, 10, 1);
+	LittleEndian::Read(Data(), family_, 11, 1);
+	LittleEndian::Read(Data(), characterSet_, 12, 1);
+	LittleEndian::Read(Data(), unused_, 13, 1);
+	name_.Read(Data()+14);
 	return RecordSize();
 }
 size_t Workbook::Font::Write(char* data)
@@ -2972,16 +3895,16 @@ Workbook::XF::XF() : Record(),
 size_t Workbook::XF::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, fontRecordIndex_, 0, 2);
-	LittleEndian::Read(data_, formatRecordIndex_, 2, 2);
-	LittleEndian::Read(data_, protectionType_, 4, 2);
-	LittleEndian::Read(data_, alignment_, 6, 1);
-	LittleEndian::Read(data_, rotation_, 7, 1);
-	LittleEndian::Read(data_, textProperties_, 8, 1);
-	LittleEndian::Read(data_, usedAttributes_, 9, 1);
-	LittleEndian::Read(data_, borderLines_, 10, 4);
-	LittleEndian::Read(data_, colour1_, 14, 4);
-	LittleEndian::Read(data_, colour2_, 18, 2);
+	LittleEndian::Read(Data(), fontRecordIndex_, 0, 2);
+	LittleEndian::Read(Data(), formatRecordIndex_, 2, 2);
+	LittleEndian::Read(Data(), protectionType_, 4, 2);
+	LittleEndian::Read(Data(), alignment_, 6, 1);
+	LittleEndian::Read(Data(), rotation_, 7, 1);
+	LittleEndian::Read(Data(), textProperties_, 8, 1);
+	LittleEndian::Read(Data(), usedAttributes_, 9, 1);
+	LittleEndian::Read(Data(), borderLines_, 10, 4);
+	LittleEndian::Read(Data(), colour1_, 14, 4);
+	LittleEndian::Read(Data(), colour2_, 18, 2);
 	return RecordSize();
 }	
 size_t Workbook::XF::Write(char* data)
@@ -3008,17 +3931,17 @@ Workbook::Style::Style() : Record(),
 size_t Workbook::Style::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, XFRecordIndex_, 0, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 0, 2);
 	if (XFRecordIndex_ & 0x8000)
 	{
 		// Built-in styles
-		LittleEndian::Read(data_, identifier_, 2, 1);
-		LittleEndian::Read(data_, level_, 3, 1);
+		LittleEndian::Read(Data(), identifier_, 2, 1);
+		LittleEndian::Read(Data(), level_, 3, 1);
 	}
 	else
 	{
 		// User-defined styles
-		name_.Read(&*(data_.begin())+2);
+		name_.Read(Data()+2);
 	}
 	return RecordSize();
 }	
@@ -3056,10 +3979,10 @@ Workbook::BoundSheet::BoundSheet() : Record(),
 size_t Workbook::BoundSheet::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, BOFpos_, 0, 4);
-	LittleEndian::Read(data_, visibility_, 4, 1);
-	LittleEndian::Read(data_, type_, 5, 1);
-	name_.Read(&*(data_.begin())+6);
+	LittleEndian::Read(Data(), BOFpos_, 0, 4);
+	LittleEndian::Read(Data(), visibility_, 4, 1);
+	LittleEndian::Read(Data(), type_, 5, 1);
+	name_.Read(Data()+6);
 	return RecordSize();
 }	
 size_t Workbook::BoundSheet::Write(char* data)
@@ -3077,21 +4000,22 @@ size_t Workbook::BoundSheet::RecordSize() {return (recordSize_ = DataSize()+4);}
 
 /************************************************************************************************************/
 Workbook::SharedStringTable::SharedStringTable() : Record(),
-	stringsTotal_(0), uniqueStringsTotal_(0) {code_ = CODE::SST; dataSize_ = 8; recordSize_ = 12;}
+	stringsTotal_(0), uniqueStringsTotal_(0), changed_(true) {code_ = CODE::SST; dataSize_ = 8; recordSize_ = 12;}
 size_t Workbook::SharedStringTable::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, stringsTotal_, 0, 4);
-	LittleEndian::Read(data_, uniqueStringsTotal_, 4, 4);
-	strings_.clear();
-	strings_.resize(uniqueStringsTotal_);
+	changed_ = true;	// CONTINUE records in the file may be placed differently from DataSize().
+	LittleEndian::Read(Data(), stringsTotal_, 0, 4);
+	LittleEndian::Read(Data(), uniqueStringsTotal_, 4, 4);
+	strings_.Clear();
+	strings_.Reserve(uniqueStringsTotal_, dataSize_);
 	
 	size_t npos = 8;
 	if (continueIndices_.empty())
 	{
 		for (size_t i=0; i<uniqueStringsTotal_; ++i)
 		{
-			npos += strings_[i].Read(&*(data_.begin())+npos);
+			npos += ReadString(Data()+npos);
 		}
 	}
 	else
@@ -3101,77 +4025,155 @@ size_t Workbook::SharedStringTable::Read(const char* data)
 
 		for (size_t i=0, c=0; i<uniqueStringsTotal_; ++i)
 		{
+			while (c<maxContinue && continueIndices_[c]<=npos) ++c;
 			char unicode;
 			size_t stringSize;
-			LittleEndian::Read(data_, stringSize, npos, 2);
-			LittleEndian::Read(data_, unicode, npos+2, 1);
+			LittleEndian::Read(Data(), stringSize, npos, 2);
+			LittleEndian::Read(Data(), unicode, npos+2, 1);
 			size_t multiplier = unicode & 1 ? 2 : 1;
 			if (c >= maxContinue || npos+stringSize*multiplier+3 <= continueIndices_[c])
 			{
 				// String to be read is not split into two records
-				npos += strings_[i].Read(&*(data_.begin())+npos);
+				npos += ReadString(Data()+npos);
 			}
 			else
 			{
-				// String to be read is split into two or more records
-				int bytesRead = 2;// Start from unicode field
-
-				int size = continueIndices_[c] - npos - 1 - bytesRead;
-				++c;
-				if (size > 0) 
+				// String to be read is split into two or more records. 
+				// Join its parts in a LargeString, which may change its encoding, then store it.
+				LargeString string;
+				size_t bytesRead = 2;// Start from unicode field
+				for (;;)
 				{
-					size /= multiplier;	// Number of characters available for string in current record.
-					bytesRead += strings_[i].ContinueRead(&*(data_.begin())+npos+bytesRead, size);
+					// Number of characters available for string in current record.
+					size_t end = (c<maxContinue) ? continueIndices_[c] : dataSize_;
+					size_t size = min(stringSize, (end-npos-bytesRead-1) / multiplier);
+					bytesRead += string.ContinueRead(Data()+npos+bytesRead, size);
 					stringSize -= size;
-					size = 0;
+					if (stringSize == 0 || c >= maxContinue) break;
+
+					// Continue from the unicode flag which starts the next CONTINUE record.
+					bytesRead = continueIndices_[c++] - npos;
+					LittleEndian::Read(Data(), unicode, npos+bytesRead, 1);
+					multiplier = unicode & 1 ? 2 : 1;
 				}
-				while (c<maxContinue && npos+stringSize+1>continueIndices_[c])
+				npos += bytesRead;
+
+				if (string.unicode_ & 1)
 				{
-					size_t dataSize = (continueIndices_[c] - continueIndices_[c-1] - 1) / multiplier;
-					bytesRead += strings_[i].ContinueRead(&*(data_.begin())+npos+bytesRead, dataSize);
-					stringSize -= dataSize + 1;
-					++c;
-				};
-				if (stringSize>0)
+					if (!string.wname_.empty()) copy(string.wname_.begin(), string.wname_.end(), strings_.AppendWString(string.wname_.size()));
+					else strings_.AppendWString(0);
+				}
+				else
 				{
-					bytesRead += strings_[i].ContinueRead(&*(data_.begin())+npos+bytesRead, stringSize);
+					if (!string.name_.empty()) copy(string.name_.begin(), string.name_.end(), strings_.AppendString(string.name_.size()));
+					else strings_.AppendString(0);
 				}
-				npos += bytesRead;
 			}
 		}
 	}
-	return npos + 4*(npos/8224 + 1);
+	return recordSize_;
 }	
+size_t Workbook::SharedStringTable::ReadString(const char* data)
+// PURPOSE: Read a string which is not split over CONTINUE records into strings_.
+// PROMISE: Returns number of bytes read, including formatting runs and phonetic data which are skipped.
+{
+	size_t stringSize;
+	char unicode;
+	short richtext = 0;
+	int phonetic = 0;
+	LittleEndian::Read(data, stringSize, 0, 2);
+	LittleEndian::Read(data, unicode, 2, 1);
+	size_t npos = 3;
+	if (unicode & 8) 
+	{
+		LittleEndian::Read(data, richtext, npos, 2);
+		npos += 2;
+	}
+	if (unicode & 4) 
+	{
+		LittleEndian::Read(data, phonetic, npos, 4);
+		npos += 4;
+	}
+	if (unicode & 1)
+	{
+		LittleEndian::ReadString(data, strings_.AppendWString(stringSize), npos, stringSize);
+		npos += stringSize * SIZEOFWCHAR_T;
+	}
+	else
+	{
+		LittleEndian::ReadString(data, strings_.AppendString(stringSize), npos, stringSize);
+		npos += stringSize;
+	}
+	return npos + 4*richtext + phonetic;
+}
+size_t Workbook::SharedStringTable::WriteString(size_t index, char* data) const
+// PURPOSE: Write string at index of strings_ without formatting runs or phonetic data.
+// PROMISE: Returns number of bytes written.
+{
+	size_t stringSize = strings_.Length(index);
+	char unicode = strings_.IsUnicode(index) ? 1 : 0;
+	LittleEndian::Write(data, stringSize, 0, 2);
+	LittleEndian::Write(data, unicode, 2, 1);
+	if (unicode) LittleEndian::WriteString(data, const_cast<wchar_t*>(strings_.WString(index)), 3, stringSize);
+	else LittleEndian::WriteString(data, const_cast<char*>(strings_.String(index)), 3, stringSize);
+	return 3 + StringSize(index);
+}
+size_t Workbook::SharedStringTable::StringSize(size_t index) const
+{
+	if (strings_.IsUnicode(index)) return strings_.Length(index) * SIZEOFWCHAR_T;
+	else return strings_.Length(index);
+}
 size_t Workbook::SharedStringTable::Write(char* data)
 {
 	data_.resize(DataSize());
 	LittleEndian::Write(data_, stringsTotal_, 0, 4);
 	LittleEndian::Write(data_, uniqueStringsTotal_, 4, 4);
 
+	// Write all strings in a single pass. A string which is split over CONTINUE records is 
+	// written aside first and then copied around the unicode flag which starts each CONTINUE record.
+	vector<char> split;
+	char* strings = &*(data_.begin());
 	size_t maxContinue = continueIndices_.size();
 	for (size_t i=0, c=0, npos=8; i<uniqueStringsTotal_; ++i)
 	{
-		npos += strings_[i].Write(&*(data_.begin())+npos);
-		if (c<maxContinue && npos==continueIndices_[c]) ++c;
-		else if (c<maxContinue && npos > continueIndices_[c])
+		while (c<maxContinue && continueIndices_[c]<=npos) ++c;
+		size_t stringSize = StringSize(i) + 3;
+		if (c == maxContinue || npos+stringSize <= continueIndices_[c])
 		{
-			// Insert unicode flag where appropriate for CONTINUE records.
-			data_.insert(data_.begin()+continueIndices_[c], strings_[i].unicode_);
-			data_.pop_back();
-			++c;
-			++npos;
+			npos += WriteString(i, strings+npos);
+			continue;
+		}
+
+		split.resize(stringSize);
+		WriteString(i, &*(split.begin()));
+		for (size_t written=0; written<stringSize; )
+		{
+			size_t end = (c<maxContinue) ? min(stringSize, written+continueIndices_[c]-npos) : stringSize;
+			copy (split.begin()+written, split.begin()+end, strings+npos);
+			npos += end - written;
+			written = end;
+			if (written < stringSize) 
+			{
+				// Insert unicode flag where appropriate for CONTINUE records.
+				strings[npos++] = strings_.IsUnicode(i) ? 1 : 0;
+				++c;
+			}
 		}
 	}
 	return Record::Write(data);
 }
 size_t Workbook::SharedStringTable::DataSize() 
 {
+	// The strings are only laid out again after they are changed.
+	if (!changed_) return dataSize_;
+	changed_ = false;
+
 	dataSize_ = 8;
 	continueIndices_.clear();
 	size_t curMax = 8224;
 	for (size_t i=0; i<uniqueStringsTotal_; ++i)
 	{
-		size_t stringSize = strings_[i].StringSize();
+		size_t stringSize = StringSize(i);
 		if (dataSize_+stringSize+3 <= curMax)
 		{
 			dataSize_ += stringSize + 3;
@@ -3180,7 +4182,7 @@ size_t Workbook::SharedStringTable::DataSize()
 		{
 			// If have >= 12 bytes (2 for size, 1 for unicode and >=9 for data, can split string
 			// otherwise, end record and start continue record.
-			bool unicode = strings_[i].unicode_ & 1;
+			bool unicode = strings_.IsUnicode(i);
 			if (curMax - dataSize_ >= 12)
 			{
 				if (unicode && !((curMax-dataSize_)%2)) --curMax;	// Make sure space reserved for unicode strings is even.
@@ -3260,7 +4262,7 @@ size_t Workbook::SharedStringTable::DataSize()
 size_t Workbook::SharedStringTable::RecordSize()
 {
 	size_t dataSize = DataSize();
-	return (recordSize_ = dataSize + 4*(dataSize/8224 + 1));
+	return (recordSize_ = dataSize + 4*(continueIndices_.size() + 1));
 }
 /************************************************************************************************************/
 Workbook::ExtSST::ExtSST() : Record(),
@@ -3274,7 +4276,7 @@ Workbook::ExtSST::ExtSST() : Record(),
 size_t Workbook::ExtSST::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, stringsTotal_, 0, 2);
+	LittleEndian::Read(Data(), stringsTotal_, 0, 2);
 
 	size_t maxPortions = (dataSize_-2) / 8;
 	streamPos_.clear();
@@ -3286,9 +4288,9 @@ size_t Workbook::ExtSST::Read(const char* data)
 
 	for (size_t i=0, npos=2; i<maxPortions; ++i)
 	{
-		LittleEndian::Read(data_, streamPos_[i], npos, 4);
-		LittleEndian::Read(data_, firstStringPos_[i], npos+4, 2);
-		LittleEndian::Read(data_, unused_[i], npos+6, 2);
+		LittleEndian::Read(Data(), streamPos_[i], npos, 4);
+		LittleEndian::Read(Data(), firstStringPos_[i], npos+4, 2);
+		LittleEndian::Read(Data(), unused_[i], npos+6, 2);
 		npos += 8;
 	}
 	return RecordSize();
@@ -3410,10 +4412,10 @@ Worksheet::Index::Index() : Record(),
 size_t Worksheet::Index::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, unused1_, 0, 4);
-	LittleEndian::Read(data_, firstUsedRowIndex_, 4, 4);
-	LittleEndian::Read(data_, firstUnusedRowIndex_, 8, 4);
-	LittleEndian::Read(data_, unused2_, 12, 4);
+	LittleEndian::Read(Data(), unused1_, 0, 4);
+	LittleEndian::Read(Data(), firstUsedRowIndex_, 4, 4);
+	LittleEndian::Read(Data(), firstUnusedRowIndex_, 8, 4);
+	LittleEndian::Read(Data(), unused2_, 12, 4);
 	size_t nm = int(firstUnusedRowIndex_ - firstUsedRowIndex_ - 1) / 32 + 1;
 	DBCellPos_.clear();
 	DBCellPos_.resize(nm);
@@ -3421,7 +4423,7 @@ size_t Worksheet::Index::Read(const char* data)
 	{
 		for (size_t i=0; i<nm; ++i)
 		{
-			LittleEndian::Read(data_, DBCellPos_[i], 16+i*4, 4);
+			LittleEndian::Read(Data(), DBCellPos_[i], 16+i*4, 4);
 		}
 	}
 	return RecordSize();
@@ -3457,11 +4459,11 @@ Worksheet::Dimensions::Dimensions() : Record(),
 size_t Worksheet::Dimensions::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, firstUsedRowIndex_, 0, 4);
-	LittleEndian::Read(data_, lastUsedRowIndexPlusOne_, 4, 4);
-	LittleEndian::Read(data_, firstUsedColIndex_, 8, 2);
-	LittleEndian::Read(data_, lastUsedColIndexPlusOne_, 10, 2);
-	LittleEndian::Read(data_, unused_, 12, 2);
+	LittleEndian::Read(Data(), firstUsedRowIndex_, 0, 4);
+	LittleEndian::Read(Data(), lastUsedRowIndexPlusOne_, 4, 4);
+	LittleEndian::Read(Data(), firstUsedColIndex_, 8, 2);
+	LittleEndian::Read(Data(), lastUsedColIndexPlusOne_, 10, 2);
+	LittleEndian::Read(Data(), unused_, 12, 2);
 	return RecordSize();
 }	
 size_t Worksheet::Dimensions::Write(char* data)
@@ -3482,9 +4484,9 @@ Worksheet::CellTable::RowBlock::CellBlock::Blank::Blank() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::Blank::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, colIndex_, 2, 2);
-	LittleEndian::Read(data_, XFRecordIndex_, 4, 2);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), colIndex_, 2, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 4, 2);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::Blank::Write(char* data)
@@ -3502,11 +4504,11 @@ Worksheet::CellTable::RowBlock::CellBlock::BoolErr::BoolErr() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::BoolErr::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, colIndex_, 2, 2);
-	LittleEndian::Read(data_, XFRecordIndex_, 4, 2);
-	LittleEndian::Read(data_, value_, 6, 1);
-	LittleEndian::Read(data_, error_, 7, 1);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), colIndex_, 2, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 4, 2);
+	LittleEndian::Read(Data(), value_, 6, 1);
+	LittleEndian::Read(Data(), error_, 7, 1);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::BoolErr::Write(char* data)
@@ -3526,10 +4528,10 @@ Worksheet::CellTable::RowBlock::CellBlock::LabelSST::LabelSST() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::LabelSST::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, colIndex_, 2, 2);
-	LittleEndian::Read(data_, XFRecordIndex_, 4, 2);
-	LittleEndian::Read(data_, SSTRecordIndex_, 6, 4);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), colIndex_, 2, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 4, 2);
+	LittleEndian::Read(Data(), SSTRecordIndex_, 6, 4);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::LabelSST::Write(char* data)
@@ -3548,15 +4550,15 @@ Worksheet::CellTable::RowBlock::CellBlock::MulBlank::MulBlank() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::MulBlank::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, firstColIndex_, 2, 2);
-	LittleEndian::Read(data_, lastColIndex_, dataSize_-2, 2);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), firstColIndex_, 2, 2);
+	LittleEndian::Read(Data(), lastColIndex_, dataSize_-2, 2);
 	size_t nc = lastColIndex_ - firstColIndex_ + 1; 
 	XFRecordIndices_.clear();
 	XFRecordIndices_.resize(nc);
 	for (size_t i=0; i<nc; ++i)
 	{
-		LittleEndian::Read(data_, XFRecordIndices_[i], 4+i*2, 2);	
+		LittleEndian::Read(Data(), XFRecordIndices_[i], 4+i*2, 2);	
 	}
 	return RecordSize();
 }	
@@ -3598,15 +4600,15 @@ Worksheet::CellTable::RowBlock::CellBlock::MulRK::MulRK() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::MulRK::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, firstColIndex_, 2, 2);
-	LittleEndian::Read(data_, lastColIndex_, dataSize_-2, 2);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), firstColIndex_, 2, 2);
+	LittleEndian::Read(Data(), lastColIndex_, dataSize_-2, 2);
 	size_t nc = lastColIndex_ - firstColIndex_ + 1; 
 	XFRK_.clear();
 	XFRK_.resize(nc);
 	for (size_t i=0; i<nc; ++i)
 	{
-		XFRK_[i].Read(&*(data_.begin())+4+i*6);
+		XFRK_[i].Read(Data()+4+i*6);
 	}
 	return RecordSize();
 }	
@@ -3635,11 +4637,11 @@ Worksheet::CellTable::RowBlock::CellBlock::Number::Number() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::Number::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, colIndex_, 2, 2);
-	LittleEndian::Read(data_, XFRecordIndex_, 4, 2);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), colIndex_, 2, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 4, 2);
 	long long value;
-	LittleEndian::Read(data_, value, 6, 8);
+	LittleEndian::Read(Data(), value, 6, 8);
 	intdouble_.intvalue_ = value;
 	value_ = intdouble_.doublevalue_;
 	return RecordSize();
@@ -3661,10 +4663,10 @@ Worksheet::CellTable::RowBlock::CellBlock::RK::RK() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::RK::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, colIndex_, 2, 2);
-	LittleEndian::Read(data_, XFRecordIndex_, 4, 2);
-	LittleEndian::Read(data_, value_, 6, 4);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), colIndex_, 2, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 4, 2);
+	LittleEndian::Read(Data(), value_, 6, 4);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::RK::Write(char* data)
@@ -3683,15 +4685,15 @@ Worksheet::CellTable::RowBlock::CellBlock::Formula::Formula() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, colIndex_, 2, 2);
-	LittleEndian::Read(data_, XFRecordIndex_, 4, 2);
-	LittleEndian::ReadString(data_, result_, 6, 8);
-	LittleEndian::Read(data_, options_, 14, 2);
-	LittleEndian::Read(data_, unused_, 16, 2);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), colIndex_, 2, 2);
+	LittleEndian::Read(Data(), XFRecordIndex_, 4, 2);
+	LittleEndian::ReadString(Data(), result_, 6, 8);
+	LittleEndian::Read(Data(), options_, 14, 2);
+	LittleEndian::Read(Data(), unused_, 16, 2);
 	RPNtoken_.clear();
 	RPNtoken_.resize(dataSize_-18);
-	LittleEndian::ReadString(data_, &*(RPNtoken_.begin()), 18, dataSize_-18);
+	LittleEndian::ReadString(Data(), &*(RPNtoken_.begin()), 18, dataSize_-18);
 
 	size_t offset = dataSize_ + 4;
 	short code;
@@ -3799,15 +4801,15 @@ Worksheet::CellTable::RowBlock::CellBlock::Formula::Array::Array() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::Array::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, firstRowIndex_, 0, 2);
-	LittleEndian::Read(data_, lastRowIndex_, 2, 2);
-	LittleEndian::Read(data_, firstColIndex_, 4, 1);
-	LittleEndian::Read(data_, lastColIndex_, 5, 1);
-	LittleEndian::Read(data_, options_, 6, 2);
-	LittleEndian::Read(data_, unused_, 8, 4);
+	LittleEndian::Read(Data(), firstRowIndex_, 0, 2);
+	LittleEndian::Read(Data(), lastRowIndex_, 2, 2);
+	LittleEndian::Read(Data(), firstColIndex_, 4, 1);
+	LittleEndian::Read(Data(), lastColIndex_, 5, 1);
+	LittleEndian::Read(Data(), options_, 6, 2);
+	LittleEndian::Read(Data(), unused_, 8, 4);
 	formula_.clear();
 	formula_.resize(dataSize_-12);
-	LittleEndian::ReadString(data_, &*(formula_.begin()), 12, dataSize_-12);
+	LittleEndian::ReadString(Data(), &*(formula_.begin()), 12, dataSize_-12);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::Array::Write(char* data)
@@ -3836,14 +4838,14 @@ Worksheet::CellTable::RowBlock::CellBlock::Formula::ShrFmla::ShrFmla() : Record(
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::ShrFmla::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, firstRowIndex_, 0, 2);
-	LittleEndian::Read(data_, lastRowIndex_, 2, 2);
-	LittleEndian::Read(data_, firstColIndex_, 4, 1);
-	LittleEndian::Read(data_, lastColIndex_, 5, 1);
-	LittleEndian::Read(data_, unused_, 6, 2);
+	LittleEndian::Read(Data(), firstRowIndex_, 0, 2);
+	LittleEndian::Read(Data(), lastRowIndex_, 2, 2);
+	LittleEndian::Read(Data(), firstColIndex_, 4, 1);
+	LittleEndian::Read(Data(), lastColIndex_, 5, 1);
+	LittleEndian::Read(Data(), unused_, 6, 2);
 	formula_.clear();
 	formula_.resize(dataSize_-8);
-	LittleEndian::ReadString(data_, &*(formula_.begin()), 8, dataSize_-8);
+	LittleEndian::ReadString(Data(), &*(formula_.begin()), 8, dataSize_-8);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::ShrFmla::Write(char* data)
@@ -3871,14 +4873,14 @@ Worksheet::CellTable::RowBlock::CellBlock::Formula::ShrFmla1::ShrFmla1() : Recor
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::ShrFmla1::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, firstRowIndex_, 0, 2);
-	LittleEndian::Read(data_, lastRowIndex_, 2, 2);
-	LittleEndian::Read(data_, firstColIndex_, 4, 1);
-	LittleEndian::Read(data_, lastColIndex_, 5, 1);
-	LittleEndian::Read(data_, unused_, 6, 2);
+	LittleEndian::Read(Data(), firstRowIndex_, 0, 2);
+	LittleEndian::Read(Data(), lastRowIndex_, 2, 2);
+	LittleEndian::Read(Data(), firstColIndex_, 4, 1);
+	LittleEndian::Read(Data(), lastColIndex_, 5, 1);
+	LittleEndian::Read(Data(), unused_, 6, 2);
 	formula_.clear();
 	formula_.resize(dataSize_-8);
-	LittleEndian::ReadString(data_, &*(formula_.begin()), 8, dataSize_-8);
+	LittleEndian::ReadString(Data(), &*(formula_.begin()), 8, dataSize_-8);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::ShrFmla1::Write(char* data)
@@ -3907,15 +4909,15 @@ Worksheet::CellTable::RowBlock::CellBlock::Formula::Table::Table() : Record(),
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::Table::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, firstRowIndex_, 0, 2);
-	LittleEndian::Read(data_, lastRowIndex_, 2, 2);
-	LittleEndian::Read(data_, firstColIndex_, 4, 1);
-	LittleEndian::Read(data_, lastColIndex_, 5, 1);
-	LittleEndian::Read(data_, options_, 6, 2);
-	LittleEndian::Read(data_, inputCellRowIndex_, 8, 2);
-	LittleEndian::Read(data_, inputCellColIndex_, 10, 2);
-	LittleEndian::Read(data_, inputCellColumnInputRowIndex_, 12, 2);
-	LittleEndian::Read(data_, inputCellColumnInputColIndex_, 14, 2);
+	LittleEndian::Read(Data(), firstRowIndex_, 0, 2);
+	LittleEndian::Read(Data(), lastRowIndex_, 2, 2);
+	LittleEndian::Read(Data(), firstColIndex_, 4, 1);
+	LittleEndian::Read(Data(), lastColIndex_, 5, 1);
+	LittleEndian::Read(Data(), options_, 6, 2);
+	LittleEndian::Read(Data(), inputCellRowIndex_, 8, 2);
+	LittleEndian::Read(Data(), inputCellColIndex_, 10, 2);
+	LittleEndian::Read(Data(), inputCellColumnInputRowIndex_, 12, 2);
+	LittleEndian::Read(Data(), inputCellColumnInputColIndex_, 14, 2);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::Table::Write(char* data)
@@ -3940,7 +4942,7 @@ size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::String::Read(const ch
 	Record::Read(data);
 	string_.clear();
 	string_.resize(dataSize_);
-	LittleEndian::ReadString(data_, &*(string_.begin()), 0, dataSize_);
+	LittleEndian::ReadString(Data(), &*(string_.begin()), 0, dataSize_);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::CellBlock::Formula::String::Write(char* data)
@@ -3964,13 +4966,13 @@ Worksheet::CellTable::RowBlock::Row::Row() : Record(),
 size_t Worksheet::CellTable::RowBlock::Row::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, rowIndex_, 0, 2);
-	LittleEndian::Read(data_, firstCellColIndex_, 2, 2);
-	LittleEndian::Read(data_, lastCellColIndexPlusOne_, 4, 2);
-	LittleEndian::Read(data_, height_, 6, 2);
-	LittleEndian::Read(data_, unused1_, 8, 2);
-	LittleEndian::Read(data_, unused2_, 10, 2);
-	LittleEndian::Read(data_, options_, 12, 4);
+	LittleEndian::Read(Data(), rowIndex_, 0, 2);
+	LittleEndian::Read(Data(), firstCellColIndex_, 2, 2);
+	LittleEndian::Read(Data(), lastCellColIndexPlusOne_, 4, 2);
+	LittleEndian::Read(Data(), height_, 6, 2);
+	LittleEndian::Read(Data(), unused1_, 8, 2);
+	LittleEndian::Read(Data(), unused2_, 10, 2);
+	LittleEndian::Read(Data(), options_, 12, 4);
 	return RecordSize();
 }	
 size_t Worksheet::CellTable::RowBlock::Row::Write(char* data)
@@ -4199,13 +5201,13 @@ Worksheet::CellTable::RowBlock::DBCell::DBCell() : Record(),
 size_t Worksheet::CellTable::RowBlock::DBCell::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, firstRowOffset_, 0, 4);
+	LittleEndian::Read(Data(), firstRowOffset_, 0, 4);
 	size_t nm = (dataSize_-4) / 2;
 	offsets_.clear();
 	offsets_.resize(nm);
 	for (size_t i=0; i<nm; ++i)
 	{
-		LittleEndian::Read(data_, offsets_[i], 4+i*2, 2);
+		LittleEndian::Read(Data(), offsets_[i], 4+i*2, 2);
 	}
 	return RecordSize();
 }	
@@ -4347,14 +5349,14 @@ Worksheet::Window2::Window2() : Record(),
 size_t Worksheet::Window2::Read(const char* data)
 {
 	Record::Read(data);
-	LittleEndian::Read(data_, options_, 0, 2);
-	LittleEndian::Read(data_, firstVisibleRowIndex_, 2, 2);
-	LittleEndian::Read(data_, firstVisibleColIndex_, 4, 2);
-	LittleEndian::Read(data_, gridLineColourIndex_, 6, 2);
-	LittleEndian::Read(data_, unused1_, 8, 2);
-	LittleEndian::Read(data_, magnificationFactorPageBreakPreview_, 10, 2);
-	LittleEndian::Read(data_, magnificationFactorNormalView_, 12, 2);
-	LittleEndian::Read(data_, unused2_, 14, 4);
+	LittleEndian::Read(Data(), options_, 0, 2);
+	LittleEndian::Read(Data(), firstVisibleRowIndex_, 2, 2);
+	LittleEndian::Read(Data(), firstVisibleColIndex_, 4, 2);
+	LittleEndian::Read(Data(), gridLineColourIndex_, 6, 2);
+	LittleEndian::Read(Data(), unused1_, 8, 2);
+	LittleEndian::Read(Data(), magnificationFactorPageBreakPreview_, 10, 2);
+	LittleEndian::Read(Data(), magnificationFactorNormalView_, 12, 2);
+	LittleEndian::Read(Data(), unused2_, 14, 4);
 	return RecordSize();
 }	
 size_t Worksheet::Window2::Write(char* data)
@@ -4460,8 +5462,8 @@ bool CanStoreAsRKValue(double value)
 /************************************************************************************************************/
 
 /************************************************************************************************************/
-BasicExcel::BasicExcel() {};
-BasicExcel::BasicExcel(const char* filename) 
+BasicExcel::BasicExcel() : strings_(0) {};
+BasicExcel::BasicExcel(const char* filename) : strings_(0)
 {
 	Load(filename);
 }
@@ -4469,6 +5471,7 @@ BasicExcel::BasicExcel(const char* filename)
 BasicExcel::~BasicExcel() 
 {
 	if (file_.IsOpen()) file_.Close();
+	if (strings_) strings_->Release();
 }
 
 // Create a new Excel workbook with a given number of spreadsheets (Minimum 1)
@@ -4476,6 +5479,9 @@ void BasicExcel::New(int sheets)
 {
 	workbook_ = Workbook();
 	worksheets_.clear();
+	stream_.clear();
+	if (strings_) strings_->Release();
+	strings_ = 0;
 
 	workbook_.fonts_.resize(4);
 	workbook_.XFs_.resize(21);
@@ -4488,60 +5494,87 @@ void BasicExcel::New(int sheets)
 }
 
 // Load an Excel workbook from a file.
-bool BasicExcel::Load(const char* filename)
+// A workbook loaded read-only is memory mapped and can only be saved with SaveAs().
+bool BasicExcel::Load(const char* filename, bool readOnly)
 {
 	if (file_.IsOpen()) file_.Close();
-	if (file_.Open(filename))
+	ios_base::openmode mode = readOnly ? ios_base::in : ios_base::in | ios_base::out;
+	if (file_.Open(filename, mode))
 	{
-		workbook_ = Workbook();
-		worksheets_.clear();
-
-		vector<char> data;
-		file_.ReadFile("Workbook", data);
-		Read(&*(data.begin()), data.size());
-		UpdateYExcelWorksheet();
+		LoadWorkbook();
 		return true;
 	}
 	else return false;
 }
 
+// Load an Excel workbook from a memory buffer.
+bool BasicExcel::LoadFromMemory(const char* data, size_t size)
+{
+	if (file_.IsOpen()) file_.Close();
+
+	// The buffer is read in place and released as soon as the workbook is parsed.
+	if (!file_.OpenMemory(data, size)) return false;
+	LoadWorkbook();
+	file_.Close();
+	return true;
+}
+
 // Save current Excel workbook to opened file.
 bool BasicExcel::Save()
 {
-	if (file_.IsOpen())
+	if (file_.IsOpen() && !file_.IsReadOnly())
 	{
+		file_.BeginTransaction();
+
 		// Prepare Raw Worksheets for saving.
 		UpdateWorksheets();
 
-		AdjustStreamPositions();	
-
 		// Calculate bytes needed for a workbook.
-		size_t minBytes = workbook_.RecordSize();
-		size_t maxWorkSheets = worksheets_.size();
-		for (size_t i=0; i<maxWorkSheets; ++i)
-		{
-			minBytes += worksheets_[i].RecordSize();
-		}
+		size_t minBytes = AdjustStreamPositions();
 		
 		// Create new workbook.
 		vector<char> data(minBytes,0);
 		Write(&*(data).begin());
 
-		if (file_.WriteFile("Workbook", data, data.size())!=CompoundFile::SUCCESS) return false;
-		return true;
+		int ret = file_.WriteFile("Workbook", data, data.size());
+		if (!file_.CommitTransaction()) return false;
+		return ret == CompoundFile::SUCCESS;
 	}
 	else return false;
 }
 
 // Save current Excel workbook to a file.
-bool BasicExcel::SaveAs(const char* filename)
+bool BasicExcel::SaveAs(const char* filename, int version, bool compact)
+{
+	if (file_.IsOpen()) file_.Close();
+
+	if (!file_.Create(filename, version)) return false;
+
+	// Save the new file's metadata only once.
+	file_.BeginTransaction();
+	bool ret = file_.MakeFile("Workbook")==CompoundFile::SUCCESS && Save();
+	if (ret && compact) ret = file_.Compact();
+	return file_.CommitTransaction() && ret;
+}
+
+// Save current Excel workbook to a memory buffer.
+bool BasicExcel::SaveToBuffer(vector<char>& data, int version)
 {
 	if (file_.IsOpen()) file_.Close();
 
-	if (!file_.Create(filename)) return false;
-	if (file_.MakeFile("Workbook")!=CompoundFile::SUCCESS) return false;
+	if (!file_.Create(version)) return false;
+
+	file_.BeginTransaction();
+	bool ret = file_.MakeFile("Workbook")==CompoundFile::SUCCESS && Save();
+	ret = file_.CommitTransaction() && ret && file_.SaveToBuffer(data);
+	file_.Close();
+	return ret;
+}
 
-	return Save();
+// Choose whether the workbook is saved in place or atomically.
+void BasicExcel::SetAtomicSave(bool atomic, int syncPolicy)
+{
+	file_.SetAtomicSave(atomic, syncPolicy);
 }
 
 // Total number of Excel worksheets in current Excel workbook.
@@ -4909,61 +5942,93 @@ size_t BasicExcel::Write(char* data)
 	return bytesWritten;
 }
 
-void BasicExcel::AdjustStreamPositions()
+void BasicExcel::LoadWorkbook()
+{
+	workbook_ = Workbook();
+	worksheets_.clear();
+
+	// Records refer to the Workbook stream, so it is kept until the workbook is replaced.
+	file_.ReadFile("Workbook", stream_);
+	Read(&*(stream_.begin()), stream_.size());
+
+	// String cells refer to the loaded shared strings until they are changed. The shared string 
+	// table is rebuilt from the cells whenever the workbook is saved, so the strings are kept apart from it.
+	// Cells of a previous workbook, and copies of them, keep their own strings alive.
+	if (strings_) strings_->Release();
+	strings_ = new SharedStrings;
+	strings_->strings_.Swap(workbook_.sst_.strings_);
+	workbook_.sst_.strings_.Clear();
+	UpdateYExcelWorksheet();
+}
+
+size_t BasicExcel::AdjustStreamPositions()
+// Lay out the workbook stream, measuring every record only once. 
+// Returns the number of bytes needed for the workbook stream.
 {
 //	AdjustExtSSTPositions();
-	AdjustBoundSheetBOFPositions();
-	AdjustDBCellPositions();
+	size_t workbookSize = workbook_.RecordSize();
+	vector<size_t> worksheetSizes(worksheets_.size());
+	AdjustDBCellPositions(workbookSize, worksheetSizes);
+	AdjustBoundSheetBOFPositions(workbookSize, worksheetSizes);
+
+	size_t bytes = workbookSize;
+	size_t maxWorkSheets = worksheetSizes.size();
+	for (size_t i=0; i<maxWorkSheets; ++i) bytes += worksheetSizes[i];
+	return bytes;
 }
 
-void BasicExcel::AdjustBoundSheetBOFPositions()
+void BasicExcel::AdjustBoundSheetBOFPositions(size_t offset, const vector<size_t>& worksheetSizes)
 {
-	size_t offset = workbook_.RecordSize();
 	size_t maxBoundSheets = workbook_.boundSheets_.size();
 	for (size_t i=0; i<maxBoundSheets; ++i)
 	{
 		workbook_.boundSheets_[i].BOFpos_ = offset;
-		offset += worksheets_[i].RecordSize();
+		offset += worksheetSizes[i];
 	}
 }
 
-void BasicExcel::AdjustDBCellPositions()
+void BasicExcel::AdjustDBCellPositions(size_t offset, vector<size_t>& worksheetSizes)
+// offset is the position of the first worksheet. The size of each worksheet is stored in worksheetSizes.
 {
-	size_t offset = workbook_.RecordSize();
+	vector<size_t> cellBlockSizes;
 	size_t maxSheets = worksheets_.size();
 	for (size_t i=0; i<maxSheets; ++i)
 	{
-		offset += worksheets_[i].bof_.RecordSize();
-		offset += worksheets_[i].index_.RecordSize();
-		offset += worksheets_[i].dimensions_.RecordSize();
+		Worksheet& worksheet = worksheets_[i];
+		size_t worksheetPos = offset;
+		offset += worksheet.bof_.RecordSize();
+		offset += worksheet.index_.RecordSize();
+		offset += worksheet.dimensions_.RecordSize();
 		
-		size_t maxRowBlocks_ = worksheets_[i].cellTable_.rowBlocks_.size();
+		size_t maxRowBlocks_ = worksheet.cellTable_.rowBlocks_.size();
 		for (size_t j=0; j<maxRowBlocks_; ++j) 
 		{
+			Worksheet::CellTable::RowBlock& rowBlock = worksheet.cellTable_.rowBlocks_[j];
 			size_t firstRowOffset = 0;
 
-			size_t maxRows = worksheets_[i].cellTable_.rowBlocks_[j].rows_.size();
+			size_t maxRows = rowBlock.rows_.size();
 			{for (size_t k=0; k<maxRows; ++k) 
 			{
-				offset += worksheets_[i].cellTable_.rowBlocks_[j].rows_[k].RecordSize();
-				firstRowOffset += worksheets_[i].cellTable_.rowBlocks_[j].rows_[k].RecordSize();
+				firstRowOffset += rowBlock.rows_[k].RecordSize();
 			}}
 			size_t cellOffset = firstRowOffset - 20; // a ROW record is 20 bytes long
 
-			size_t maxCellBlocks = worksheets_[i].cellTable_.rowBlocks_[j].cellBlocks_.size();
+			size_t maxCellBlocks = rowBlock.cellBlocks_.size();
+			cellBlockSizes.resize(maxCellBlocks);
 			{for (size_t k=0; k<maxCellBlocks; ++k) 
 			{
-				offset += worksheets_[i].cellTable_.rowBlocks_[j].cellBlocks_[k].RecordSize();
-				firstRowOffset += worksheets_[i].cellTable_.rowBlocks_[j].cellBlocks_[k].RecordSize();
+				cellBlockSizes[k] = rowBlock.cellBlocks_[k].RecordSize();
+				firstRowOffset += cellBlockSizes[k];
 			}}
+			offset += firstRowOffset;
 
 			// Adjust Index DBCellPos_ absolute offset
-			worksheets_[i].index_.DBCellPos_[j] = offset; 
+			worksheet.index_.DBCellPos_[j] = offset; 
 			
-			offset += worksheets_[i].cellTable_.rowBlocks_[j].dbcell_.RecordSize();
+			offset += rowBlock.dbcell_.RecordSize();
 
 			// Adjust DBCell first row offsets
-			worksheets_[i].cellTable_.rowBlocks_[j].dbcell_.firstRowOffset_ = firstRowOffset;
+			rowBlock.dbcell_.firstRowOffset_ = firstRowOffset;
 
 			// Adjust DBCell offsets
 			size_t l=0;
@@ -4971,21 +6036,20 @@ void BasicExcel::AdjustDBCellPositions()
 			{
 				for (; l<maxCellBlocks; ++l)
 				{
-					if (worksheets_[i].cellTable_.rowBlocks_[j].rows_[k].rowIndex_ <=
-						worksheets_[i].cellTable_.rowBlocks_[j].cellBlocks_[l].RowIndex())
+					if (rowBlock.rows_[k].rowIndex_ <= rowBlock.cellBlocks_[l].RowIndex())
 					{
-						worksheets_[i].cellTable_.rowBlocks_[j].dbcell_.offsets_[k] = cellOffset;
+						rowBlock.dbcell_.offsets_[k] = cellOffset;
 						break;
 					}
-					cellOffset += worksheets_[i].cellTable_.rowBlocks_[j].cellBlocks_[l].RecordSize();
+					cellOffset += cellBlockSizes[l];
 				}
 				cellOffset = 0;
 			}}
 		}	
 		
-		offset += worksheets_[i].cellTable_.RecordSize();
-		offset += worksheets_[i].window2_.RecordSize();
-		offset += worksheets_[i].eof_.RecordSize();
+		offset += worksheet.window2_.RecordSize();
+		offset += worksheet.eof_.RecordSize();
+		worksheetSizes[i] = offset - worksheetPos;
 	}
 }
 
@@ -5023,8 +6087,8 @@ void BasicExcel::AdjustExtSSTPositions()
 
 		for (size_t j=0; j<workbook_.extSST_.stringsTotal_; ++j)
 		{
-			if (i*workbook_.extSST_.stringsTotal_+j >= workbook_.sst_.strings_.size()) break;
-			size_t stringSize = workbook_.sst_.strings_[i*workbook_.extSST_.stringsTotal_+j].StringSize();
+			if (i*workbook_.extSST_.stringsTotal_+j >= workbook_.sst_.strings_.Size()) break;
+			size_t stringSize = workbook_.sst_.StringSize(i*workbook_.extSST_.stringsTotal_+j);
 			if (relativeOffset+stringSize+3 < 8224)
 			{
 				relativeOffset += stringSize + 3;
@@ -5097,12 +6161,6 @@ void BasicExcel::UpdateWorksheets()
 	Worksheet::CellTable::RowBlock::CellBlock cellBlock;
 	Worksheet::CellTable::RowBlock::Row row;
 	Worksheet::CellTable::RowBlock::CellBlock::MulRK::XFRK xfrk;
-	LargeString largeString;
-
-	map<vector<char>, size_t> stringMap;
-	map<vector<char>, size_t>::iterator stringMapIt;
-	map<vector<wchar_t>, size_t> wstringMap;
-	map<vector<wchar_t>, size_t>::iterator wstringMapIt;
 
 	// Reset worksheets and string table.
 	worksheets_.clear();
@@ -5110,7 +6168,8 @@ void BasicExcel::UpdateWorksheets()
 	
 	workbook_.sst_.stringsTotal_ = 0;
 	workbook_.sst_.uniqueStringsTotal_ = 0;
-	workbook_.sst_.strings_.clear();
+	workbook_.sst_.strings_.Clear();
+	workbook_.sst_.changed_ = true;
 
 	for (size_t s=0; s<maxWorksheets; ++s)
 	{
@@ -5283,35 +6342,10 @@ void BasicExcel::UpdateWorksheets()
 							pCell->normalType_ = true;
 							pCell->labelsst_.rowIndex_ = r;
 							pCell->labelsst_.colIndex_ = c;
-							
-							// Get cell string
-							vector<char> str(cell->GetStringLength()+1);
-							cell->Get(&*(str.begin()));
-							str.pop_back();	// Remove null character because LargeString does not store null character.
 
-							// Check if string is present in Shared string table.
+							// Find or add string in Shared string table.
 							++workbook_.sst_.stringsTotal_;
-							size_t maxUniqueStrings = workbook_.sst_.uniqueStringsTotal_;
-							size_t strIndex = 0;
-							stringMapIt = stringMap.find(str);
-							if (stringMapIt != stringMap.end()) strIndex = stringMapIt->second;
-							else strIndex = maxUniqueStrings;
-
-							if (strIndex < maxUniqueStrings)
-							{
-								// String is present in Shared string table.
-								pCell->labelsst_.SSTRecordIndex_ = strIndex;
-							}
-							else
-							{
-								// New unique string.
-								stringMap[str] = maxUniqueStrings;
-								workbook_.sst_.strings_.push_back(largeString);
-								workbook_.sst_.strings_[maxUniqueStrings].name_ = str;
-								workbook_.sst_.strings_[maxUniqueStrings].unicode_ = 0;
-								pCell->labelsst_.SSTRecordIndex_ = maxUniqueStrings;
-								++workbook_.sst_.uniqueStringsTotal_;
-							}
+							pCell->labelsst_.SSTRecordIndex_ = workbook_.sst_.strings_.Add(cell->GetString(), cell->GetStringLength());
 							break;
 						}
 
@@ -5323,34 +6357,9 @@ void BasicExcel::UpdateWorksheets()
 							pCell->labelsst_.rowIndex_ = r;
 							pCell->labelsst_.colIndex_ = c;
 
-							// Get cell string
-							vector<wchar_t> str(cell->GetStringLength()+1);
-							cell->Get(&*(str.begin()));
-							str.pop_back(); // Remove null character because LargeString does not store null character.
-
-							// Check if string is present in Shared string table.
+							// Find or add string in Shared string table.
 							++workbook_.sst_.stringsTotal_;
-							size_t maxUniqueStrings = workbook_.sst_.strings_.size();
-							size_t strIndex = 0;
-							wstringMapIt = wstringMap.find(str);
-							if (wstringMapIt != wstringMap.end()) strIndex = wstringMapIt->second;
-							else strIndex = maxUniqueStrings;
-
-							if (strIndex < maxUniqueStrings)
-							{
-								// String is present in Shared string table.
-								pCell->labelsst_.SSTRecordIndex_ = strIndex;
-							}
-							else
-							{
-								// New unique string
-								wstringMap[str] = maxUniqueStrings;
-								workbook_.sst_.strings_.push_back(largeString);
-								workbook_.sst_.strings_[maxUniqueStrings].wname_ = str;
-								workbook_.sst_.strings_[maxUniqueStrings].unicode_ = 1;
-								pCell->labelsst_.SSTRecordIndex_ = maxUniqueStrings;
-								++workbook_.sst_.uniqueStringsTotal_;
-							}
+							pCell->labelsst_.SSTRecordIndex_ = workbook_.sst_.strings_.Add(cell->GetWString(), cell->GetStringLength());
 							break;
 						}
 					}
@@ -5375,6 +6384,8 @@ void BasicExcel::UpdateWorksheets()
 			worksheets_[s].dimensions_.firstUsedColIndex_ = 0;
 		}
 	}
+
+	workbook_.sst_.uniqueStringsTotal_ = workbook_.sst_.strings_.Size();
 }
 /************************************************************************************************************/
 
@@ -5576,9 +6587,6 @@ void BasicExcelWorksheet::UpdateCells()
 	Worksheet::Dimensions& dimension = excel_->worksheets_[sheetIndex_].dimensions_;
 	vector<Worksheet::CellTable::RowBlock>& rRowBlocks = excel_->worksheets_[sheetIndex_].cellTable_.rowBlocks_;
 
-	vector<wchar_t> wstr;
-	vector<char> str;
-
 	maxRows_ = dimension.lastUsedRowIndexPlusOne_;
 	maxCols_ = dimension.lastUsedColIndexPlusOne_;
 
@@ -5609,21 +6617,7 @@ void BasicExcelWorksheet::UpdateCells()
 					
 				case CODE::LABELSST:
 				{
-					vector<LargeString>& ss = excel_->workbook_.sst_.strings_;
-					if (ss[rCellBlocks[j].labelsst_.SSTRecordIndex_].unicode_ & 1)
-					{
-						wstr = ss[rCellBlocks[j].labelsst_.SSTRecordIndex_].wname_;
-						wstr.resize(wstr.size()+1);
-						wstr.back() = L'\0';
-						cells_[row][col].Set(&*(wstr.begin()));						
-					}
-					else
-					{
-						str = ss[rCellBlocks[j].labelsst_.SSTRecordIndex_].name_;
-						str.resize(str.size()+1);
-						str.back() = '\0';
-						cells_[row][col].Set(&*(str.begin()));
-					}
+					cells_[row][col].SetShared(excel_->strings_, rCellBlocks[j].labelsst_.SSTRecordIndex_);
 					break;
 				}
 
@@ -5676,7 +6670,28 @@ void BasicExcelWorksheet::UpdateCells()
 /************************************************************************************************************/
 
 /************************************************************************************************************/
-BasicExcelCell::BasicExcelCell() : type_(UNDEFINED) {};
+BasicExcelCell::BasicExcelCell() : type_(UNDEFINED), strings_(0), stringIndex_(0) {};
+BasicExcelCell::BasicExcelCell(const BasicExcelCell& cell) :
+	type_(cell.type_), ival_(cell.ival_), dval_(cell.dval_), str_(cell.str_), wstr_(cell.wstr_),
+	strings_(cell.strings_), stringIndex_(cell.stringIndex_)
+{
+	if (strings_) strings_->Acquire();
+}
+BasicExcelCell::~BasicExcelCell() {ReleaseShared();}
+BasicExcelCell& BasicExcelCell::operator=(const BasicExcelCell& cell)
+{
+	SharedStrings* strings = cell.strings_;
+	if (strings) strings->Acquire();	// Before releasing, in case both cells refer to the same strings.
+	ReleaseShared();
+	type_ = cell.type_;
+	ival_ = cell.ival_;
+	dval_ = cell.dval_;
+	str_ = cell.str_;
+	wstr_ = cell.wstr_;
+	strings_ = strings;
+	stringIndex_ = cell.stringIndex_;
+	return *this;
+}
 
 // Get type of value stored in current Excel cell. 
 // Returns one of the enums.
@@ -5722,8 +6737,9 @@ bool BasicExcelCell::Get(char* str) const
 {
 	if (type_ == STRING)
 	{
-		if (str_.empty()) *str = '\0';
-		else strcpy(str, &*(str_.begin()));
+		const char* s = GetString();
+		if (s == 0) *str = '\0';
+		else strcpy(str, s);
 		return true;
 	}
 	else return false;
@@ -5735,8 +6751,9 @@ bool BasicExcelCell::Get(wchar_t* str) const
 {
 	if (type_ == WSTRING)
 	{
-		if (wstr_.empty()) *str = L'\0';
-		else wcscpy(str, &*(wstr_.begin()));
+		const wchar_t* s = GetWString();
+		if (s == 0) *str = L'\0';
+		else wcscpy(str, s);
 		return true;
 	}
 	else return false;
@@ -5745,6 +6762,7 @@ bool BasicExcelCell::Get(wchar_t* str) const
 // Return length of ANSI or Unicode string (excluding null character).
 size_t BasicExcelCell::GetStringLength() const
 {
+	if (strings_) return strings_->strings_.Length(stringIndex_);
 	if (type_ == STRING) return str_.size() - 1;
 	else return wstr_.size() - 1;
 }
@@ -5771,8 +6789,9 @@ double BasicExcelCell::GetDouble() const
 // Returns 0 if cell does not contain an ANSI string.
 const char* BasicExcelCell::GetString() const
 {
-	vector<char> str(str_.size());
-	if (!str.empty() && Get(&*(str.begin()))) return &*(str_.begin());
+	if (type_ != STRING) return 0;
+	if (strings_) return strings_->strings_.String(stringIndex_);
+	if (!str_.empty()) return &*(str_.begin());
 	else return 0;
 }
 
@@ -5780,8 +6799,9 @@ const char* BasicExcelCell::GetString() const
 // Returns 0 if cell does not contain an Unicode string.
 const wchar_t* BasicExcelCell::GetWString() const
 {
-	vector<wchar_t> wstr(wstr_.size());
-	if (!wstr.empty() && Get(&*(wstr.begin()))) return &*(wstr_.begin());
+	if (type_ != WSTRING) return 0;
+	if (strings_) return strings_->strings_.WString(stringIndex_);
+	if (!wstr_.empty()) return &*(wstr_.begin());
 	else return 0;
 }
 
@@ -5814,6 +6834,7 @@ void BasicExcelCell::SetInteger(int val)
 {
 	type_ = INT; 
 	ival_ = val;
+	ReleaseShared();
 }
 
 // Set content of current Excel cell to a double.
@@ -5821,6 +6842,7 @@ void BasicExcelCell::SetDouble(double val)
 {
 	type_ = DOUBLE; 
 	dval_ = val;
+	ReleaseShared();
 }
 
 // Set content of current Excel cell to an ANSI string.
@@ -5833,6 +6855,7 @@ void BasicExcelCell::SetString(const char* str)
 		str_ = vector<char>(length+1);
 		strcpy(&*(str_.begin()), str);
 		wstr_.clear();
+		ReleaseShared();
 	}
 	else EraseContents();
 }
@@ -5847,6 +6870,7 @@ void BasicExcelCell::SetWString(const wchar_t* str)
 		wstr_ = vector<wchar_t>(length+1);
 		wcscpy(&*(wstr_.begin()), str);
 		str_.clear();
+		ReleaseShared();
 	}
 	else EraseContents();
 }
@@ -5858,6 +6882,31 @@ void BasicExcelCell::EraseContents()
 	type_ = UNDEFINED;
 	str_.clear();
 	wstr_.clear();
+	ReleaseShared();
+}
+
+// Refer to a string in strings instead of storing a copy of it. 
+// The string is copied into the cell only when the cell is changed.
+void BasicExcelCell::SetShared(SharedStrings* strings, size_t index)
+{
+	if (strings->strings_.Length(index) > 0)
+	{
+		strings->Acquire();
+		ReleaseShared();
+		type_ = strings->strings_.IsUnicode(index) ? WSTRING : STRING;
+		str_.clear();
+		wstr_.clear();
+		strings_ = strings;
+		stringIndex_ = index;
+	}
+	else EraseContents();
+}
+
+// Stop referring to a shared string.
+void BasicExcelCell::ReleaseShared()
+{
+	if (strings_) strings_->Release();
+	strings_ = 0;
 }
 
 ///< Print cell to output stream.
@@ -49,6 +49,7 @@
 
 #include <algorithm>
 #include <cmath>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <iomanip>
@@ -64,22 +65,41 @@ using namespace std;
 	#define SIZEOFWCHAR_T sizeof(wchar_t)
 #endif
 
+// Hosts which store integers in little endian byte order read and write fields with memcpy.
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+	#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		#define LITTLE_ENDIAN_HOST
+	#endif
+#elif defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM) || defined(_M_ARM64) || defined(__i386__) || defined(__x86_64__)
+	#define LITTLE_ENDIAN_HOST
+#endif
+
 namespace YCompoundFiles
 {
 class Block
 // PURPOSE: In charge of handling blocks of data from a file
 {
 public:
+	enum {SYNC_NONE, SYNC_DATA, SYNC_FULL};	// Disk synchronisation policies for atomic saving
+
 	Block();
+	~Block();
 
 // File handling functions
 	bool Create(const wchar_t* filename);
+	bool Create();
 	bool Open(const wchar_t* filename, ios_base::openmode mode=ios_base::in | ios_base::out);
+	bool Open(const char* data, size_t size);
 	bool Close();
 	bool IsOpen();
+	bool IsReadOnly() const {return !(mode_ & ios_base::out);}
+	bool Flush();
+	void CopyTo(vector<char>& data) const;
+	void SetAtomicSave(bool atomic, int syncPolicy=SYNC_FULL);
 
 // Block handling functions
-	bool Read(size_t index, char* block);
+	bool Read(size_t index, char* block, size_t count=1);
+	const char* Data(size_t index) const;
 	bool Write(size_t index, const char* block);
 	bool Swap(size_t index1, size_t index2);
 	bool Move(size_t from, size_t to);
@@ -89,28 +109,48 @@ public:
 
 // Misc functions
 	size_t GetBlockSize() const {return blockSize_;}
-	void SetBlockSize(size_t size) 
-	{
-		blockSize_ = size;
-		indexEnd_ = fileSize_/blockSize_ + (fileSize_ % blockSize_ ? 1 : 0);
-	}
+	size_t GetBlockCount() const {return indexEnd_;}
+	void SetBlockSize(size_t size);
 	
 protected:
+	bool Replace();
+	bool Truncate();
+	bool Map();
+	void Unmap();
 	vector<char> filename_;
 	ios_base::openmode mode_;
 	fstream file_;
 	size_t blockSize_;
 	size_t indexEnd_;
 	size_t fileSize_;
+	const char* mapping_;	// Memory mapped file or buffer given to Open() if the file is opened read-only, 0 otherwise
+	vector<char> image_;	// Contents of all blocks if the file is opened for writing
+	vector<bool> dirty_;	// Blocks in image_ which are changed since the last flush
+	bool rewrite_;			// True if blocks were erased and the file must be truncated
+	bool memory_;			// True if the file is held only in image_ without an open handle
+	bool atomic_;			// True if files are saved atomically through a temporary file
+	int syncPolicy_;		// Disk synchronisation policy for atomic saving
 };
 
 struct LittleEndian
+// PURPOSE: Read and write little endian fields of bytes bytes, or sizeof(Type) bytes if bytes is 0.
+// EXPLAIN: On little endian hosts a field which is not wider than its type is copied with memcpy, 
+// EXPLAIN: which compilers turn into a single unaligned load or store when bytes is a constant.
+// EXPLAIN: Strings of bytes characters are copied with a single memcpy, except that 16 bit 
+// EXPLAIN: characters are converted to and from a wider wchar_t with SSE2 or AVX2 where available.
 {
 	template<typename Type>
 	static void Read(const char* buffer, Type& retVal, int pos=0, int bytes=0)
 	{
 		retVal = Type(0);
 		if (bytes == 0) bytes = sizeof(Type);
+#ifdef LITTLE_ENDIAN_HOST
+		if (bytes <= (int)sizeof(Type))
+		{
+			memcpy(&retVal, buffer+pos, bytes);
+			return;
+		}
+#endif
 		for (size_t i=0; i<bytes; ++i)
 		{
 			retVal |= ((Type)((unsigned char)buffer[pos+i])) << 8*i;
@@ -120,13 +160,24 @@ struct LittleEndian
 	template<typename Type>
 	static void ReadString(const char* buffer, Type* str, int pos=0, int bytes=0)
 	{
+#ifdef LITTLE_ENDIAN_HOST
+		if (bytes > 0) memcpy(str, buffer+pos, bytes*sizeof(Type));
+#else
 		for (size_t i=0; i<bytes; ++i) Read(buffer, str[i], pos+i*sizeof(Type));
+#endif
 	}
 
 	template<typename Type>
 	static void Write(char* buffer, Type val, int pos=0, int bytes=0)
 	{
 		if (bytes == 0) bytes = sizeof(Type);
+#ifdef LITTLE_ENDIAN_HOST
+		if (bytes <= (int)sizeof(Type))
+		{
+			memcpy(buffer+pos, &val, bytes);
+			return;
+		}
+#endif
 		for (size_t i=0; i<bytes; ++i)
 		{
 			buffer[pos+i] = (unsigned char)val;
@@ -137,41 +188,35 @@ struct LittleEndian
 	template<typename Type>
 	static void WriteString(char* buffer, Type* str, int pos=0, int bytes=0)
 	{
+#ifdef LITTLE_ENDIAN_HOST
+		if (bytes > 0) memcpy(buffer+pos, str, bytes*sizeof(Type));
+#else
 		for (size_t i=0; i<bytes; ++i) Write(buffer, str[i], pos+i*sizeof(Type));
+#endif
 	}
 
 	template<typename Type>
 	static void Read(const vector<char>& buffer, Type& retVal, int pos=0, int bytes=0)
 	{
-		retVal = Type(0);
-		if (bytes == 0) bytes = sizeof(Type);
-		for (size_t i=0; i<bytes; ++i)
-		{
-			retVal |= ((Type)((unsigned char)buffer[pos+i])) << 8*i;
-		}
+		Read(&*(buffer.begin()), retVal, pos, bytes);
 	}
 
 	template<typename Type>
 	static void ReadString(const vector<char>& buffer, Type* str, int pos=0, int bytes=0)
 	{
-		for (size_t i=0; i<bytes; ++i) Read(buffer, str[i], pos+i*sizeof(Type));
+		ReadString(&*(buffer.begin()), str, pos, bytes);
 	}
 
 	template<typename Type>
 	static void Write(vector<char>& buffer, Type val, int pos=0, int bytes=0)
 	{
-		if (bytes == 0) bytes = sizeof(Type);
-		for (size_t i=0; i<bytes; ++i)
-		{
-			buffer[pos+i] = (unsigned char)val;
-			val >>= 8;
-		}
+		Write(&*(buffer.begin()), val, pos, bytes);
 	}
 
 	template<typename Type>
 	static void WriteString(vector<char>& buffer, Type* str, int pos=0, int bytes=0)
 	{
-		for (size_t i=0; i<bytes; ++i) Write(buffer, str[i], pos+i*sizeof(Type));
+		WriteString(&*(buffer.begin()), str, pos, bytes);
 	}
 
 
@@ -179,20 +224,31 @@ struct LittleEndian
 	{
 		retVal = wchar_t(0);
 		if (bytes == 0) bytes = SIZEOFWCHAR_T;
+#ifdef LITTLE_ENDIAN_HOST
+		if (bytes <= (int)sizeof(wchar_t))
+		{
+			memcpy(&retVal, buffer+pos, bytes);
+			return;
+		}
+#endif
 		for (int i=0; i<bytes; ++i)
 		{
 			retVal |= ((wchar_t)((unsigned char)buffer[pos+i])) << 8*i;
 		}
 	}
 
-	static void ReadString(const char* buffer, wchar_t* str, int pos=0, int bytes=0)
-	{
-		for (int i=0; i<bytes; ++i) Read(buffer, str[i], pos+i*SIZEOFWCHAR_T);
-	}
+	static void ReadString(const char* buffer, wchar_t* str, int pos=0, int bytes=0);
 
 	static void Write(char* buffer, wchar_t val, int pos=0, int bytes=0)
 	{
 		if (bytes == 0) bytes = SIZEOFWCHAR_T;
+#ifdef LITTLE_ENDIAN_HOST
+		if (bytes <= (int)sizeof(wchar_t))
+		{
+			memcpy(buffer+pos, &val, bytes);
+			return;
+		}
+#endif
 		for (int i=0; i<bytes; ++i)
 		{
 			buffer[pos+i] = (unsigned char)val;
@@ -200,40 +256,32 @@ struct LittleEndian
 		}
 	}
 
-	static void WriteString(char* buffer, wchar_t* str, int pos=0, int bytes=0)
-	{
-		for (int i=0; i<bytes; ++i) Write(buffer, str[i], pos+i*SIZEOFWCHAR_T);
-	}
+	static void WriteString(char* buffer, wchar_t* str, int pos=0, int bytes=0);
 
 	static void Read(const vector<char>& buffer, wchar_t& retVal, int pos=0, int bytes=0)
 	{
-		retVal = wchar_t(0);
-		if (bytes == 0) bytes = SIZEOFWCHAR_T;
-		for (int i=0; i<bytes; ++i)
-		{
-			retVal |= ((wchar_t)((unsigned char)buffer[pos+i])) << 8*i;
-		}
+		Read(&*(buffer.begin()), retVal, pos, bytes);
 	}
 
 	static void ReadString(const vector<char>& buffer, wchar_t* str, int pos=0, int bytes=0)
 	{
-		for (int i=0; i<bytes; ++i) Read(buffer, str[i], pos+i*SIZEOFWCHAR_T);
+		ReadString(&*(buffer.begin()), str, pos, bytes);
 	}
 
 	static void Write(vector<char>& buffer, wchar_t val, int pos=0, int bytes=0)
 	{
-		if (bytes == 0) bytes = SIZEOFWCHAR_T;
-		for (int i=0; i<bytes; ++i)
-		{
-			buffer[pos+i] = (unsigned char)val;
-			val >>= 8;
-		}
+		Write(&*(buffer.begin()), val, pos, bytes);
 	}
 
 	static void WriteString(vector<char>& buffer, wchar_t* str, int pos=0, int bytes=0)
 	{
-		for (int i=0; i<bytes; ++i) Write(buffer, str[i], pos+i*SIZEOFWCHAR_T);
+		WriteString(&*(buffer.begin()), str, pos, bytes);
 	}
+
+	// Conversions between wide characters and 8 bit characters, such as compressed Excel strings.
+	static void Widen(const char* buffer, wchar_t* str, size_t size);
+	static void Narrow(const wchar_t* str, char* buffer, size_t size);
+	static bool FitsLatin1(const wchar_t* str, size_t size);
 };
 
 class CompoundFile
@@ -244,6 +292,7 @@ public:
 		  DIRECTORY_NOT_EMPTY=-3, DIRECTORY_NOT_FOUND=-2, 
 		  INVALID_PATH=-1, 
 		  SUCCESS=1};
+	enum {COMPACT, APPEND_ONLY};	// Policies for freed big blocks, see SetAllocationPolicy()
 
 	CompoundFile();
 	~CompoundFile();
@@ -251,10 +300,21 @@ public:
 // User accessible functions
 public:
 	// Compound File functions
-	bool Create(const wchar_t* filename);
+	bool Create(const wchar_t* filename, int version=3);
+	bool Create(int version=3);
 	bool Open(const wchar_t* filename, ios_base::openmode mode=ios_base::in | ios_base::out);
+	bool OpenMemory(const char* data, size_t size);
+	bool SaveToBuffer(vector<char>& data);
 	bool Close();
 	bool IsOpen();
+	bool IsReadOnly() const {return file_.IsReadOnly();}
+	bool Flush();
+	void BeginTransaction();
+	bool CommitTransaction();
+	void SetAllocationPolicy(int policy);
+	int GetAllocationPolicy() const {return allocationPolicy_;}
+	void SetAtomicSave(bool atomic, int syncPolicy=Block::SYNC_FULL);
+	bool Compact();
 
 	// Directory functions
 	int ChangeDirectory(const wchar_t* path);
@@ -276,7 +336,7 @@ public:
 
 
 	// ANSI char functions
-	bool Create(const char* filename);
+	bool Create(const char* filename, int version=3);
 	bool Open(const char* filename, ios_base::openmode mode=ios_base::in | ios_base::out);
 	int ChangeDirectory(const char* path);
 	int MakeDirectory(const char* path);
@@ -295,19 +355,22 @@ public:
 // Protected functions and data members
 protected:
 	// General functions and data members
-	void IncreaseLocationReferences(vector<size_t> indices);
-	void DecreaseLocationReferences(vector<size_t> indices);
+	void DecreaseLocationReferences(const vector<size_t>& indices, int* reference=0);
 	void SplitPath(const wchar_t* path, wchar_t*& parentpath, wchar_t*& propertyname);
+	void NewFile(int version);
+	bool LoadFile();
 	vector<char> block_;
 	Block file_;
 
 	// Header related functions and data members
 	bool LoadHeader();
 	void SaveHeader();
+	void SaveMetadata();
+	bool WriteBlock(size_t index, const char* block);
 	class Header
 	{
 	public:
-		Header();
+		Header(int version=3);
 		void Write(char* block);
 		void Read(char* block);
 
@@ -317,12 +380,12 @@ protected:
 		int uk3_;					// Unknown constant (0x0010)
 		int uk4_;					// Unknown constant (0x0014)
 		short uk5_;					// Unknown constant (revision?) (0x0018)
-		short uk6_;					// Unknown constant	(version?) (0x001A)
+		short uk6_;					// Major version, 3 for 512 byte or 4 for 4096 byte big blocks (0x001A)
 		short uk7_;					// Unknown constant (0x001C)
 		short log2BigBlockSize_;	// Log, base 2, of the big block size (0x001E)
 		int log2SmallBlockSize_;	// Log, base 2, of the small block size (0x0020)
 		int uk8_;					// Unknown constant (0x0024)
-		int uk9_;					// Unknown constant (0x0028)
+		int uk9_;					// Number of blocks holding the property table in version 4, 0 otherwise (0x0028)
 		int BATCount_;				// Number of elements in the BAT array (0x002C)
 		int propertiesStart_;		// Block index of the first block of the property table (0x0030)
 		int uk10_;					// Unknown constant (0x0034)
@@ -340,20 +403,39 @@ protected:
 		void Initialize();
 	};	
 	Header header_;
+	size_t transactionDepth_;	// Number of transactions started and not yet committed
+	bool metadataChanged_;		// True if metadata must be saved when the transaction is committed
 
 	// BAT related functions and data members
 	void LoadBAT();
 	void SaveBAT();
 	size_t DataSize(size_t startIndex, bool isBig);
-	size_t ReadData(size_t startIndex, char* data, bool isBig);
+	size_t ReadData(size_t startIndex, char* data, bool isBig, size_t size=size_t(-1));
 	size_t WriteData(const char* data, size_t size, int startIndex, bool isBig);
 	void GetBlockIndices(size_t startIndex, vector<size_t>& indices, bool isBig);
+	const vector<size_t>& BlockChain(size_t startIndex, bool isBig);
+	void InvalidateBlockChains(bool isBig);
 	size_t GetFreeBlockIndex(bool isBig);
 	void ExpandBATArray(bool isBig);
 	void LinkBlocks(size_t from, size_t to, bool isBig);
-	void FreeBlocks(vector<size_t>& indices, bool isBig);
+	int LinkRun(size_t& index, size_t count, bool isBig);
+	void FreeBlocks(vector<size_t>& indices, bool isBig, int* reference=0);
+	void FindFreeBlocks(bool isBig, size_t from=0);
 	vector<int> blocksIndices_;
 	vector<int> sblocksIndices_;	
+	vector<size_t> BATIndices_;			// Locations of the BAT blocks, from the header BAT array and the XBAT
+	vector<size_t> XBATIndices_;		// Locations of the XBAT blocks in chain order
+	vector<size_t> freeBlocksIndices_;	// Free BAT indices in descending order
+	vector<size_t> freeSBlocksIndices_;	// Free SBAT indices in descending order
+	int allocationPolicy_;				// COMPACT or APPEND_ONLY
+	map<size_t, vector<size_t> > blocksChains_;		// Cached BAT chains keyed by start index
+	map<size_t, vector<size_t> > sblocksChains_;	// Cached SBAT chains keyed by start index
+
+	// Mini stream related functions and data members
+	vector<char>& MiniStream();
+	void SaveMiniStream();
+	vector<char> miniStream_;		// Cached data of the Root Entry holding all small blocks
+	bool miniStreamLoaded_;			// True if miniStream_ holds the current mini stream
 
 	// Properties related functions and data members
 	class Property
@@ -408,10 +490,15 @@ protected:
 	public:
 		PropertyTree();
 		~PropertyTree();
+		void IndexChild(PropertyTree* child);
+		void UnindexChild(PropertyTree* child);
+		PropertyTree* FindChild(const wchar_t* name) const;
+		static size_t NameHash(const wchar_t* name);
 		PropertyTree* parent_;
 		Property* self_;
 		size_t index_;
 		vector<PropertyTree*> children_;
+		vector<vector<PropertyTree*> > childrenIndex_;	// Children in buckets by name hash, number of buckets is a power of 2
 	};
 	void LoadProperties();
 	void SaveProperties();
@@ -541,8 +628,10 @@ public:
 	virtual size_t Write(char* data);	
 	virtual size_t DataSize();
 	virtual size_t RecordSize();
+	const char* Data() const;
 	short code_;
 	vector<char> data_;
+	const char* view_;		// Record data in the buffer given to Read() while data_ is empty
 	size_t dataSize_;
 	size_t recordSize_;
 	vector<size_t> continueIndices_;
@@ -607,6 +696,63 @@ struct LargeString
 	int phonetic_;
 };
 
+class StringPool
+// PURPOSE: Store strings one after another in a single arena and find them again by content.
+// EXPLAIN: An ANSI string is stored as chars and a Unicode string as wchar_ts, each followed by a 
+// EXPLAIN: null character. An open addressing hash table of entry indices, probed by precomputed 
+// EXPLAIN: hashes, finds a string in constant time without copying it. Appended strings are 
+// EXPLAIN: only hashed when Add() is next called.
+{
+public:
+	StringPool();
+	void Clear();
+	void Swap(StringPool& pool);
+	void Reserve(size_t strings, size_t bytes);
+	size_t Add(const char* str, size_t length);		// Return index of ANSI string, adding it if not present.
+	size_t Add(const wchar_t* str, size_t length);	// Return index of Unicode string, adding it if not present.
+	char* AppendString(size_t length);		// Add an ANSI string even if present and return where to store its characters.
+	wchar_t* AppendWString(size_t length);	// Add an Unicode string even if present and return where to store its characters.
+	size_t Size() const;
+	bool IsUnicode(size_t index) const;
+	size_t Length(size_t index) const;
+	const char* String(size_t index) const;		// Return 0 if string is in Unicode.
+	const wchar_t* WString(size_t index) const;	// Return 0 if string is in ANSI.
+
+private:
+	struct Entry
+	{
+		size_t offset_;		// Offset of string in arena_.
+		size_t length_;		// Number of characters excluding null character.
+		size_t hash_;
+		bool unicode_;
+	};
+	static size_t Hash(const char* data, size_t bytes, bool unicode);
+	size_t Add(const char* data, size_t bytes, size_t length, bool unicode);
+	char* Append(size_t length, bool unicode);
+	void Rehash(size_t capacity);
+
+	vector<char> arena_;
+	vector<Entry> entries_;
+	vector<size_t> slots_;	// Index of entry plus one, or 0 if slot is empty. Size is a power of two.
+	size_t hashed_;			// Number of entries which are in slots_.
+};
+
+class SharedStrings
+// PURPOSE: Hold the shared strings of a loaded workbook for the string cells which refer to them.
+// EXPLAIN: The strings are reference counted. They are deleted when the workbook and every cell 
+// EXPLAIN: referring to them, including copies of cells, no longer need them.
+{
+public:
+	SharedStrings();	// The creator holds the first reference.
+	void Acquire();
+	void Release();		// Delete the strings when the last reference is released.
+	StringPool strings_;
+
+private:
+	~SharedStrings();
+	size_t references_;
+};
+
 class Workbook
 {
 public:
@@ -710,9 +856,15 @@ public:
 		virtual size_t Write(char* data);	
 		virtual size_t DataSize();
 		virtual size_t RecordSize();
+		size_t StringSize(size_t index) const;
 		int stringsTotal_;
 		int uniqueStringsTotal_;
-		vector<LargeString> strings_;	
+		StringPool strings_;
+		bool changed_;	// True if strings_ changed since DataSize() last placed the CONTINUE records
+
+	private:
+		size_t ReadString(const char* data);
+		size_t WriteString(size_t index, char* data) const;
 	};
 	struct ExtSST : public Record
 	{
@@ -1118,9 +1270,12 @@ public:
 
 public: // File functions.
 	void New(int sheets=3);	///< Create a new Excel workbook with a given number of spreadsheets (Minimum 1).
-	bool Load(const char* filename);	///< Load an Excel workbook from a file.
-	bool Save();	///< Save current Excel workbook to opened file.
-	bool SaveAs(const char* filename);	///< Save current Excel workbook to a file.
+	bool Load(const char* filename, bool readOnly=false);	///< Load an Excel workbook from a file. A workbook loaded read-only is memory mapped and can only be saved with SaveAs().
+	bool Save();	///< Save current Excel workbook to opened file. Returns false if the workbook was loaded read-only.
+	bool SaveAs(const char* filename, int version=3, bool compact=false);	///< Save current Excel workbook to a file. version is 3 for a compound file with 512 byte blocks or 4 for 4096 byte blocks, which suits large workbooks. If compact is true, every stream is stored in one contiguous run of blocks so that it is read sequentially.
+	bool LoadFromMemory(const char* data, size_t size);	///< Load an Excel workbook from a memory buffer. The buffer is only read during the call. The workbook can be saved with SaveAs() or SaveToBuffer().
+	bool SaveToBuffer(vector<char>& data, int version=3);	///< Save current Excel workbook to a memory buffer. version is as in SaveAs().
+	void SetAtomicSave(bool atomic, int syncPolicy=Block::SYNC_FULL);	///< Save to a temporary file in the same directory and rename it over the target, so the target is never left half written. syncPolicy is Block::SYNC_NONE, SYNC_DATA or SYNC_FULL. Call before Load() or SaveAs().
 
 public: // Worksheet functions.
 	size_t GetTotalWorkSheets();	///< Total number of Excel worksheets in current Excel workbook.
@@ -1150,15 +1305,16 @@ public: // Worksheet functions.
 private: // Functions to read and write raw Excel format.
 	size_t Read(const char* data, size_t dataSize);
 	size_t Write(char* data);
-	void AdjustStreamPositions();
-	void AdjustBoundSheetBOFPositions();
-	void AdjustDBCellPositions();
+	size_t AdjustStreamPositions();
+	void AdjustBoundSheetBOFPositions(size_t offset, const vector<size_t>& worksheetSizes);
+	void AdjustDBCellPositions(size_t offset, vector<size_t>& worksheetSizes);
 	void AdjustExtSSTPositions();
 
 	enum {WORKBOOK_GLOBALS=0x0005, VISUAL_BASIC_MODULE=0x0006,
 		  WORKSHEET=0x0010, CHART=0x0020};
 	
 private: // Internal functions
+	void LoadWorkbook();			///< Read workbook_ and worksheets_ from the opened compound file.
 	void UpdateYExcelWorksheet();	///< Update yesheets_ using information from worksheets_.
 	void UpdateWorksheets();		///< Update worksheets_ using information from yesheets_.
 
@@ -1167,6 +1323,8 @@ public:
 	Workbook workbook_;						///< Raw Workbook.
 	vector<Worksheet> worksheets_;			///< Raw Worksheets.
 	vector<BasicExcelWorksheet> yesheets_;	///< Parsed Worksheets.
+	vector<char> stream_;					///< Workbook stream which the raw records read from it refer to.
+	SharedStrings* strings_;				///< Shared strings of the loaded workbook which string cells refer to, or 0.
 };
 
 class BasicExcelWorksheet
@@ -1205,8 +1363,13 @@ private:
 
 class BasicExcelCell
 {
+	friend class BasicExcelWorksheet;
+
 public:
 	BasicExcelCell();
+	BasicExcelCell(const BasicExcelCell& cell);
+	~BasicExcelCell();
+	BasicExcelCell& operator=(const BasicExcelCell& cell);
 
 public:
 	enum {UNDEFINED, INT, DOUBLE, STRING, WSTRING};
@@ -1238,11 +1401,16 @@ public:
 	void EraseContents();	///< Erase the content of current Excel cell. Set type to UNDEFINED.
 
 private:
+	void SetShared(SharedStrings* strings, size_t index);	///< Refer to a string in strings instead of storing a copy of it.
+	void ReleaseShared();	///< Stop referring to a shared string.
+
 	int type_;				///< Type of value stored in current Excel cell. Contains one of the above enums.
 	int ival_;				///< Integer value stored in current Excel cell.
 	double dval_;			///< Double value stored in current Excel cell.
 	vector<char> str_;		///< ANSI string stored in current Excel cell. Include null character.
 	vector<wchar_t> wstr_;	///< Unicode string stored in current Excel cell. Include null character.
+	SharedStrings* strings_;	///< Strings which the string in current Excel cell refers to, or 0 if the cell stores its own string.
+	size_t stringIndex_;	///< Index of the string in strings_->strings_.
 };
 
 } // Namespace end